@@ -172,26 +172,19 @@ _on_client_read(struct tcp_connect *connect)
 }
 
 static int 
-_on_accept(struct event_channel *channel)
+_on_accept(struct event_loop_pool *e_pool, struct event_loop *e_loop, int client_fd, void *userdata)
 {
-    int ret = 0;
-    char ip[256] = {0};
-    char err[256] = {0};
-    unsigned short port = 0;
-    int tcp_server_fd = event_channel_get_fd(channel);
-    struct event_loop_pool *e_pool = (struct event_loop_pool *) event_channel_get_userdata(channel);
-
-    int client_fd = net_tcp_accept(tcp_server_fd, ip, sizeof(ip), &port, err, sizeof(err));
-    if (client_fd != -1) {
-        struct event_loop *e_loop = event_loop_pool_next(e_pool);
-        struct tcp_connect *connect = tcp_connect_create(client_fd, e_loop, _on_client_read, _on_client_write, _on_client_close);
-        printf("%s>%d>accept(%d) client fd=%d, ip=%s, port=%d, connect=%p\n", __FUNCTION__, __LINE__, tcp_server_fd, client_fd, ip, port, connect);
-    } else {
-        printf("%s>%d>accept(%d) fail, error=\"%s\"\n", __FUNCTION__, __LINE__, tcp_server_fd, err);
-        ret = -1;
-    }
-
-    return ret;
+    struct tcp_connect_options options = {0};
+    struct tcp_connect *connect;
+
+    /* on the thread of e_loop */
+    options.is_edge = 1;
+    options.is_recv = 1;
+    /* drop half-open clients */
+    options.idle_timeout_ms = 60 * 1000;
+    connect = tcp_connect_create_with_options(client_fd, e_loop, _on_client_read, _on_client_write, _on_client_close, &options);
+    printf("%s>%d>accept client fd=%d, connect=%p\n", __FUNCTION__, __LINE__, client_fd, connect);
+    return 0;
 }
 
 static int
@@ -207,7 +200,6 @@ _run_server(unsigned short port)
     int ret = 0;
     struct event_loop_pool *e_pool = NULL;
     struct event_loop *e_loop = NULL;
-    struct event_channel *channel = NULL;
     struct tcp_server *server = NULL;
     char err[256] = {0};
     long long timer_id;
@@ -218,43 +210,27 @@ _run_server(unsigned short port)
         goto EXIT;
     }
 
-    channel = event_channel_create();
-    if (!channel) {
-        event_loop_pool_delete(&e_pool);
-        ret = -2;
-        goto EXIT;
+    /* every loop accepts its own connections, one acceptor without SO_REUSEPORT */
+    server = tcp_server_open_on_pool(e_pool, "0.0.0.0", port, 1000, NULL, _on_accept, NULL, err, sizeof(err));
+    if (!server) {
+        /* tcp_connect is created by the loop it runs on */
+        server = tcp_server_open("0.0.0.0", port, 1000, err, sizeof(err));
+        if (server && event_loop_pool_listen(e_pool, tcp_server_get_fd(server), _on_accept, NULL) != 0)
+            tcp_server_close(&server);
     }
-
-    server = tcp_server_open("0.0.0.0", port, 1000, err, sizeof(err));
     if (!server) {
-        event_channel_delete(&channel);
         event_loop_pool_delete(&e_pool);
         ret = -3;
         goto EXIT;
     }
 
-    printf("%s>%d>listen to %d\n", __FUNCTION__, __LINE__, port);
-
-    event_channel_set_fd(channel, tcp_server_get_fd(server));
-    event_channel_add_mask(channel, FD_MASK_READ);
-    event_channel_set_userdata(channel, e_pool);
-    event_channel_set_read_proc(channel, _on_accept);
+    printf("%s>%d>listen to %d, backend=%s\n", __FUNCTION__, __LINE__, port, event_loop_get_backend(event_loop_pool_get_girst(e_pool)));
 
     e_loop = event_loop_pool_next(e_pool);
-    ret = event_loop_add_channel(e_loop, channel);
-    if (ret) {
-        tcp_server_close(&server);
-        event_channel_delete(&channel);
-        event_loop_pool_delete(&e_pool);
-        ret = -4;
-        goto EXIT;
-    }
-
     timer_id = event_loop_add_timer(e_loop, 5000, timer_type_forever, _on_timer_proc, server);
     if (timer_id < 1) {
-        event_loop_remove_channel(e_loop, channel);
+        event_loop_pool_unlisten(e_pool, tcp_server_get_fd(server));
         tcp_server_close(&server);
-        event_channel_delete(&channel);
         event_loop_pool_delete(&e_pool);
         ret = -5;
         goto EXIT;
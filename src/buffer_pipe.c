@@ -94,6 +94,20 @@ buffer_pipe_write_head(struct buffer_pipe *pipe, char *data, size_t length)
     return ret;
 }
 
+char *
+buffer_pipe_reserve(struct buffer_pipe *pipe, size_t length)
+{
+    if (pipe->length + length > pipe->actual_length && buffer_pipe_expand(pipe, length) != 0)
+        return NULL;
+    return pipe->data + pipe->length;
+}
+
+void 
+buffer_pipe_commit(struct buffer_pipe *pipe, size_t length)
+{
+    pipe->length += length;
+}
+
 size_t 
 buffer_pipe_read(struct buffer_pipe *pipe, char *data, size_t length)
 {
@@ -18,6 +18,10 @@ int buffer_pipe_expand(struct buffer_pipe *pipe, size_t length);
 int buffer_pipe_write(struct buffer_pipe *pipe, char *data, size_t length);
 int buffer_pipe_write_head(struct buffer_pipe *pipe, char *data, size_t length);
 
+/* receive directly into the tail: reserve space, fill it, then commit the filled length */
+char *buffer_pipe_reserve(struct buffer_pipe *pipe, size_t length);
+void buffer_pipe_commit(struct buffer_pipe *pipe, size_t length);
+
 size_t buffer_pipe_read(struct buffer_pipe *pipe, char *data, size_t length);
 int buffer_pipe_find_chr(struct buffer_pipe *pipe, char mark, size_t *pos);
 
@@ -7,11 +7,21 @@ enum fd_mask {
     FD_MASK_WRITE = 2,
     FD_MASK_ERROR = 4,
     FD_MASK_CLOSE = 8,
+    /* register as edge-triggered, handlers must drain until EAGAIN */
+    FD_MASK_EDGE = 16,
+    /* backend receives into recv pipe before read proc, eof and error call close proc */
+    FD_MASK_RECV = 32,
 };
 
+#define FD_MASK_IO  (FD_MASK_READ | FD_MASK_WRITE | FD_MASK_ERROR)
+
+struct event_channel;
+
+/* ready event filled by event_io_poll, channel is NULL once it is removed in dispatch */
 struct event_io_event {
     int fd;
     enum fd_mask mask;
+    struct event_channel *channel;
 };
 
 #endif
@@ -15,6 +15,8 @@
 struct event_channel {
     int fd;
     int mask;
+    int io_mask;
+    int io_index;
     event_channel_proc procs[PROC_END_OF];
     void *userdata;
 
@@ -148,6 +150,30 @@ event_channel_clear_mask(struct event_channel *channel)
     channel->mask = FD_MASK_NONE;
 }
 
+void 
+event_channel_set_io_mask(struct event_channel *channel, int mask)
+{
+    channel->io_mask = mask;
+}
+
+int
+event_channel_get_io_mask(struct event_channel *channel)
+{
+    return channel->io_mask;
+}
+
+void 
+event_channel_set_io_index(struct event_channel *channel, int index)
+{
+    channel->io_index = index;
+}
+
+int
+event_channel_get_io_index(struct event_channel *channel)
+{
+    return channel->io_index;
+}
+
 void 
 event_channel_set_read_proc(struct event_channel *channel, event_channel_proc proc)
 {
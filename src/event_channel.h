@@ -44,6 +44,14 @@ int event_channel_is_equal_mask(struct event_channel *channel, int mask);
 int event_channel_is_exist_mask(struct event_channel *channel, int mask);
 void event_channel_clear_mask(struct event_channel *channel);
 
+/* mask currently registered in event_io, maintained by the backend */
+void event_channel_set_io_mask(struct event_channel *channel, int mask);
+int event_channel_get_io_mask(struct event_channel *channel);
+
+/* slot of the channel inside event_io, maintained by the backend */
+void event_channel_set_io_index(struct event_channel *channel, int index);
+int event_channel_get_io_index(struct event_channel *channel);
+
 void event_channel_set_read_proc(struct event_channel *channel, event_channel_proc proc);
 void event_channel_set_write_proc(struct event_channel *channel, event_channel_proc proc);
 void event_channel_set_error_proc(struct event_channel *channel, event_channel_proc proc);
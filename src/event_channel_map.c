@@ -10,12 +10,19 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 
 #include "event_channel_map.h"
-#include "common/list.h"
 
+/*
+ * fd is small and dense, so channels are indexed by fd directly, the array
+ * grows to the largest fd ever added.
+ */
 struct event_channel_map {
-    struct list *channel_list;
+    struct event_channel **channels;
+    int capacity;
+    size_t length;
+    int max_fd;
 };
 
 struct event_channel_map *
@@ -23,10 +30,7 @@ event_channel_map_create(void)
 {
     struct event_channel_map *map = (struct event_channel_map *) calloc(1, sizeof(*map));
 
-    if (map) {
-        map->channel_list = list_create();
-        if (!map->channel_list) event_channel_map_delete(&map);
-    }    
+    if (map)    map->max_fd = -1;
     return map;
 }
 
@@ -36,100 +40,109 @@ event_channel_map_delete(struct event_channel_map **mapp)
     struct event_channel_map *map = mapp && (*mapp) ? (*mapp) : NULL;
     if (!map)   return;
 
-    list_delete(&map->channel_list, NULL);
+    free(map->channels);
     free(map);
     *mapp = NULL;
 }
 
-static struct event_channel *
-_map_find(struct event_channel_map *map, int fd, struct list_node **nodep)
+static int
+_map_expand(struct event_channel_map *map, int fd)
 {
-    struct event_channel *channel;
-	struct list_node *node;
+    int capacity = map->capacity ? map->capacity : 64;
+    struct event_channel **channels;
 
-    for (node = list_get_head(map->channel_list); node != NULL; node = list_get_next(node)) {
-        if (nodep)  *nodep = node;
+    while (capacity <= fd)  capacity *= 2;
 
-        channel = (struct event_channel *) list_get_data(node);
-        if (event_channel_get_fd(channel) == fd)
-            return channel;
-    }
+    channels = (struct event_channel **) realloc(map->channels, capacity * sizeof(*channels));
+    if (!channels)  return -1;
 
-    return NULL;
+    memset(channels + map->capacity, 0, (capacity - map->capacity) * sizeof(*channels));
+    map->channels = channels;
+    map->capacity = capacity;
+    return 0;
 }
 
 int 
 event_channel_map_add(struct event_channel_map *map, struct event_channel *channel)
 {
-    return list_append(map->channel_list, (void *) channel);
+    int fd = event_channel_get_fd(channel);
+
+    if (fd < 0)
+        return -1;
+    if (fd >= map->capacity && _map_expand(map, fd) != 0)
+        return -1;
+
+    /* one channel per fd */
+    if (map->channels[fd])
+        return map->channels[fd] == channel ? 0 : -1;
+
+    map->channels[fd] = channel;
+    map->length++;
+    if (fd > map->max_fd)   map->max_fd = fd;
+    return 0;
 }
 
 int 
 event_channel_map_remove(struct event_channel_map *map, int fd)
 {
-    struct list_node *node = NULL;
+    if (fd < 0 || fd >= map->capacity || !map->channels[fd])
+        return -1;
+
+    map->channels[fd] = NULL;
+    map->length--;
 
-    _map_find(map, fd, &node);
-    return list_remove_node(map->channel_list, node, NULL);
+    /* walk down to the next live fd */
+    if (fd == map->max_fd) {
+        while (map->max_fd >= 0 && !map->channels[map->max_fd])
+            map->max_fd--;
+    }
+    return 0;
 }
 
 struct event_channel *
 event_channel_map_find(struct event_channel_map *map, int fd)
 {
-    return _map_find(map, fd, NULL);
+    if (fd < 0 || fd >= map->capacity)
+        return NULL;
+    return map->channels[fd];
 }
 
 size_t 
 event_channel_map_get_length(struct event_channel_map *map)
 {
-    return list_length(map->channel_list);
+    return map->length;
 }
 
 int 
 event_channel_map_get_max_fd(struct event_channel_map *map)
 {
-    int ret = -1;
-    int fd;    
-    struct event_channel *channel;
-    struct list_node *node;
-
-    for (node = list_get_head(map->channel_list); node != NULL; node = list_get_next(node)) {
-        channel = (struct event_channel *) list_get_data(node);        
-        fd = event_channel_get_fd(channel);
-        if (fd > ret)   ret = fd;
+    return map->max_fd;
+}
+
+static struct event_channel *
+_map_seek(struct event_channel_map *map, int fd, void **meta)
+{
+    for (/**/; fd <= map->max_fd; fd++) {
+        if (map->channels[fd]) {
+            /* keep meta not NULL */
+            if (meta)   *meta = (void *) (intptr_t) (fd + 1);
+            return map->channels[fd];
+        }
     }
 
-    return ret;
+    return NULL;
 }
 
 struct event_channel *
 event_channel_map_get_head(struct event_channel_map *map, void **meta)
 {
-    struct event_channel *channel = NULL;
-    struct list_node *node = list_get_head(map->channel_list);
-
-    if (node) {
-        channel = (struct event_channel *) list_get_data(node);
-        if (meta)   *meta = node;
-    }
-
-    return channel;
-
+    return _map_seek(map, 0, meta);
 }
 
 struct event_channel *
 event_channel_map_get_next(struct event_channel_map *map, void **meta)
 {
-    struct event_channel *channel = NULL;
-    struct list_node *node = (struct list_node *) (*meta);
-
-    if (node) {
-        node = list_get_next(node);
-        if (node) {
-            channel = (struct event_channel *) list_get_data(node);
-            if (meta)   *meta = node;
-        }
-    }
-
-    return channel;
+    if (!meta || !(*meta))
+        return NULL;
+    return _map_seek(map, (int) (intptr_t) (*meta), meta);
 }
@@ -0,0 +1,137 @@
+/*
+ * event io
+ *
+ * Copyright (c) 2024 kyleliu <justfavme at gmail dot com>
+ * All rights reserved.
+ *
+ * This file is part of Eloop.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "event_io.h"
+
+#define ENV_BACKEND     "ELOOP_BACKEND"
+
+extern const struct event_io_ops event_io_select_ops;
+extern const struct event_io_ops event_io_poll_ops;
+extern const struct event_io_ops event_io_epoll_ops;
+extern const struct event_io_ops event_io_uring_ops;
+extern const struct event_io_ops event_io_kqueue_ops;
+
+/* default order, io_uring is only used when asked for */
+static const struct event_io_ops *_backends[] = {
+#if defined(__linux) || defined(__linux__)
+    &event_io_epoll_ops,
+    &event_io_poll_ops,
+#elif defined(__APPLE__) || defined(__FreeBSD__)
+    &event_io_kqueue_ops,
+    &event_io_poll_ops,
+#endif
+    &event_io_select_ops,
+    NULL,
+};
+
+static const struct event_io_ops *_optional_backends[] = {
+#if defined(__linux) || defined(__linux__)
+    &event_io_uring_ops,
+#endif
+    NULL,
+};
+
+struct event_io {
+    const struct event_io_ops *ops;
+    struct event_io_backend *backend;
+};
+
+static const struct event_io_ops *
+_find(const char *name)
+{
+    for (int i = 0; _backends[i] != NULL; i++) {
+        if (strcmp(_backends[i]->name, name) == 0)
+            return _backends[i];
+    }
+    for (int i = 0; _optional_backends[i] != NULL; i++) {
+        if (strcmp(_optional_backends[i]->name, name) == 0)
+            return _optional_backends[i];
+    }
+    return NULL;
+}
+
+static int
+_try(struct event_io *eio, const struct event_io_ops *ops)
+{
+    eio->backend = ops->create();
+    if (eio->backend)
+        eio->ops = ops;
+    return eio->backend ? 0 : -1;
+}
+
+struct event_io *
+event_io_create(const char *name)
+{
+    const struct event_io_ops *ops = NULL;
+    struct event_io *eio = (struct event_io *) calloc(1, sizeof(*eio));
+
+    if (!eio)   goto FAIL;
+
+    if (name == NULL || name[0] == '\0')
+        name = getenv(ENV_BACKEND);
+    if (name && name[0] != '\0')
+        ops = _find(name);
+
+    /* asked one, e.g. io_uring blocked by seccomp, falls back to default order */
+    if (ops && _try(eio, ops) == 0)
+        goto EXIT;
+    for (int i = 0; _backends[i] != NULL; i++) {
+        if (_backends[i] != ops && _try(eio, _backends[i]) == 0)
+            goto EXIT;
+    }
+
+FAIL:
+    event_io_delete(&eio);
+EXIT:
+    return eio;
+}
+
+void 
+event_io_delete(struct event_io **eiop)
+{
+    struct event_io *eio = eiop && (*eiop) ? (*eiop) : NULL;
+    if (!eio)   return;
+
+    if (eio->backend)   eio->ops->destroy(&eio->backend);
+    free(eio);
+    *eiop = NULL;
+}
+
+const char *
+event_io_get_name(struct event_io *eio)
+{
+    return eio->ops->name;
+}
+
+int 
+event_io_get_features(struct event_io *eio)
+{
+    return eio->ops->get_features(eio->backend);
+}
+
+int 
+event_io_add_fd(struct event_io *eio, struct event_channel *channel)
+{
+    return eio->ops->add_fd(eio->backend, channel);
+}
+
+int 
+event_io_remove_fd(struct event_io *eio, struct event_channel *channel)
+{
+    return eio->ops->remove_fd(eio->backend, channel);
+}
+
+int 
+event_io_poll(struct event_io *eio, struct event_io_event *events, int max_events, unsigned long long timeout)
+{
+    return eio->ops->poll(eio->backend, events, max_events, timeout);
+}
@@ -7,15 +7,44 @@ extern "C" {
 
 #include <time.h>
 
+#include "event.h"
+
 struct event_io;
-struct event_channel_map;
+struct event_io_backend;
 struct event_channel;
 
-struct event_io *event_io_create(void);
+/* poll timeout is in microseconds, this one blocks until an event */
+#define EVENT_IO_TIMEOUT_INFINITE   (~0ULL)
+
+enum event_io_feature {
+    EVENT_IO_FEATURE_EDGE = 1,
+    /* FD_MASK_RECV */
+    EVENT_IO_FEATURE_RECV = 2,
+};
+
+/* backend vtable, each event_io_xxx.c defines its own struct event_io_backend */
+struct event_io_ops {
+    const char *name;
+    struct event_io_backend *(*create)(void);
+    void (*destroy)(struct event_io_backend **backendp);
+    int (*get_features)(struct event_io_backend *backend);
+    int (*add_fd)(struct event_io_backend *backend, struct event_channel *channel);
+    int (*remove_fd)(struct event_io_backend *backend, struct event_channel *channel);
+    int (*poll)(struct event_io_backend *backend, struct event_io_event *events, int max_events, unsigned long long timeout);
+};
+
+/* 
+ * name is one of select, poll, epoll, uring and kqueue, NULL reads ELOOP_BACKEND 
+ * from environment, falls back to the default order when unavailable.
+ */
+struct event_io *event_io_create(const char *name);
 void event_io_delete(struct event_io **eiop);
+const char *event_io_get_name(struct event_io *eio);
+int event_io_get_features(struct event_io *eio);
 int event_io_add_fd(struct event_io *eio, struct event_channel *channel);
 int event_io_remove_fd(struct event_io *eio, struct event_channel *channel);
-int event_io_poll(struct event_io *eio, struct event_channel_map *ec_map, unsigned long long timeout);
+/* fill at most max_events ready events, returns the count or -1 */
+int event_io_poll(struct event_io *eio, struct event_io_event *events, int max_events, unsigned long long timeout);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,181 @@
+/*
+ * event io epoll implementation
+ *
+ * Copyright (c) 2024 kyleliu <justfavme at gmail dot com>
+ * All rights reserved.
+ *
+ * This file is part of Eloop.
+ */
+
+#include <sys/epoll.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "event_io.h"
+#include "event_channel.h"
+
+#define EPOLL_EVENTS_MAX    1024
+
+/* epoll_pwait2 takes a timespec since glibc 2.35 and kernel 5.11 */
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 35))
+#define EPOLL_HAVE_PWAIT2
+#endif
+
+struct event_io_backend {
+    int epfd;
+    int no_pwait2;
+    struct epoll_event events[EPOLL_EVENTS_MAX];
+};
+
+static unsigned int
+_mask_2_events(int mask)
+{
+    unsigned int events = 0;
+
+    if (mask & FD_MASK_READ)    events |= EPOLLIN;
+    if (mask & FD_MASK_WRITE)   events |= EPOLLOUT;
+    if (mask & FD_MASK_ERROR)   events |= EPOLLPRI;
+    if (mask & FD_MASK_EDGE)    events |= EPOLLET;
+    return events;
+}
+
+static int
+_ctl(struct event_io_backend *eio, struct event_channel *channel, int old_mask, int new_mask)
+{
+    struct epoll_event ev = {0};
+    int op;
+
+    /* edge flag alone is not an interest */
+    if ((new_mask & FD_MASK_IO) == FD_MASK_NONE)
+        new_mask = FD_MASK_NONE;
+    if (old_mask == new_mask)
+        return 0;
+
+    if (old_mask == FD_MASK_NONE)       op = EPOLL_CTL_ADD;
+    else if (new_mask == FD_MASK_NONE)  op = EPOLL_CTL_DEL;
+    else                                op = EPOLL_CTL_MOD;
+
+    ev.events = _mask_2_events(new_mask);
+    ev.data.ptr = channel;
+    if (epoll_ctl(eio->epfd, op, event_channel_get_fd(channel), &ev) == -1) {
+        /* fd may be closed before remove */
+        if (op != EPOLL_CTL_DEL)
+            return -1;
+    }
+
+    event_channel_set_io_mask(channel, new_mask);
+    return 0;
+}
+
+static void _delete(struct event_io_backend **eiop);
+
+static struct event_io_backend *
+_create(void)
+{
+    struct event_io_backend *eio = (struct event_io_backend *) calloc(1, sizeof(*eio));
+    if (!eio) goto FAIL;
+
+    eio->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (eio->epfd == -1) goto FAIL;
+
+    goto EXIT;
+FAIL:
+    _delete(&eio);
+EXIT:
+    return eio;
+}
+
+static void
+_delete(struct event_io_backend **eiop)
+{
+    struct event_io_backend *eio = eiop && (*eiop) ? (*eiop) : NULL;
+    if (!eio) return;
+    if (eio->epfd != -1) close(eio->epfd);
+    free(eio);
+    *eiop = NULL;
+}
+
+static int
+_get_features(struct event_io_backend *eio)
+{
+    return EVENT_IO_FEATURE_EDGE;
+}
+
+static int
+_add_fd(struct event_io_backend *eio, struct event_channel *channel)
+{
+    int io_mask = event_channel_get_io_mask(channel);
+
+    return _ctl(eio, channel, io_mask, io_mask | event_channel_get_mask(channel));
+}
+
+static int
+_remove_fd(struct event_io_backend *eio, struct event_channel *channel)
+{
+    int io_mask = event_channel_get_io_mask(channel);
+
+    return _ctl(eio, channel, io_mask, io_mask & ~event_channel_get_mask(channel));
+}
+
+static int
+_poll(struct event_io_backend *eio, struct event_io_event *events, int max_events, unsigned long long timeout)
+{
+    int n = -1;
+
+    if (max_events > EPOLL_EVENTS_MAX)  max_events = EPOLL_EVENTS_MAX;
+#if defined(EPOLL_HAVE_PWAIT2)
+    if (!eio->no_pwait2) {
+        struct timespec ts = {timeout / 1000000, (timeout % 1000000) * 1000};
+
+        n = epoll_pwait2(eio->epfd, eio->events, max_events
+                , timeout == EVENT_IO_TIMEOUT_INFINITE ? NULL : &ts, NULL);
+        if (n < 0 && errno == ENOSYS)
+            eio->no_pwait2 = 1;
+    }
+    if (eio->no_pwait2)
+#endif
+    {
+        /* round up, waking before the deadline only spins */
+        int ms = timeout == EVENT_IO_TIMEOUT_INFINITE ? -1 
+            : (int) ((timeout + 999) / 1000 > 0x7fffffff ? 0x7fffffff : (timeout + 999) / 1000);
+
+        n = epoll_wait(eio->epfd, eio->events, max_events, ms);
+    }
+    if (n < 0)
+        return errno == EINTR ? 0 : -1;
+
+    for (int i = 0; i < n; i++) {
+        struct event_channel *channel = (struct event_channel *) eio->events[i].data.ptr;
+        unsigned int ev = eio->events[i].events;
+        int io_mask = event_channel_get_io_mask(channel);
+        int mask = FD_MASK_NONE;
+
+        /* error and hangup are reported by read or write */
+        if (ev & (EPOLLERR | EPOLLHUP)) {
+            if (io_mask & FD_MASK_READ)         ev |= EPOLLIN;
+            else if (io_mask & FD_MASK_WRITE)   ev |= EPOLLOUT;
+        }
+        if (ev & EPOLLIN)   mask |= FD_MASK_READ;
+        if (ev & EPOLLOUT)  mask |= FD_MASK_WRITE;
+        if (ev & EPOLLPRI)  mask |= FD_MASK_ERROR;
+
+        events[i].fd = event_channel_get_fd(channel);
+        events[i].mask = (enum fd_mask) mask;
+        events[i].channel = channel;
+    }
+
+    return n;
+}
+
+const struct event_io_ops event_io_epoll_ops = {
+    .name = "epoll",
+    .create = _create,
+    .destroy = _delete,
+    .get_features = _get_features,
+    .add_fd = _add_fd,
+    .remove_fd = _remove_fd,
+    .poll = _poll,
+};
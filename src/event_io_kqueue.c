@@ -19,18 +19,19 @@
 
 #include "event_io.h"
 #include "event_channel.h"
-#include "event_channel_map.h"
 
-struct event_io {
+struct event_io_backend {
     int kqfd;
     struct kevent events[FD_SETSIZE];
     struct kevent events_back[FD_SETSIZE];
 };
 
-struct event_io *
-event_io_create(void)
+static void _delete(struct event_io_backend **eiop);
+
+static struct event_io_backend *
+_create(void)
 {
-    struct event_io *eio = (struct event_io *) calloc(1, sizeof(*eio));
+    struct event_io_backend *eio = (struct event_io_backend *) calloc(1, sizeof(*eio));
     if (!eio) goto FAIL;
 
     eio->kqfd = kqueue();
@@ -42,39 +43,46 @@ event_io_create(void)
 
     goto EXIT;
 FAIL:
-    event_io_delete(&eio);
+    _delete(&eio);
 EXIT:
     return eio;
 }
 
-void 
-event_io_delete(struct event_io **eiop)
+static void
+_delete(struct event_io_backend **eiop)
 {
-    struct event_io *eio = eiop && (*eiop) ? (*eiop) : NULL;
+    struct event_io_backend *eio = eiop && (*eiop) ? (*eiop) : NULL;
     if (!eio) return;
     if (eio->kqfd != -1) close(eio->kqfd);
     free(eio);
     *eiop = NULL;
 }
 
-int 
-event_io_add_fd(struct event_io *eio, struct event_channel *channel)
+static int
+_get_features(struct event_io_backend *eio)
+{
+    return EVENT_IO_FEATURE_EDGE;
+}
+
+static int
+_add_fd(struct event_io_backend *eio, struct event_channel *channel)
 {
     int fd = event_channel_get_fd(channel);
-    int mask = event_channel_get_mask(channel);
+    int mask = event_channel_get_mask(channel) & FD_MASK_IO;
+    int action = EV_ADD | (event_channel_is_exist_mask(channel, FD_MASK_EDGE) ? EV_CLEAR : 0);
     int flag = 0;
 
     for (int i = 0; i < FD_SETSIZE; i++) {
         if (!(flag & FD_MASK_READ) && (mask & FD_MASK_READ) && (eio->events[i].ident == -1)) {
-            EV_SET(&eio->events[i], fd, EVFILT_READ, EV_ADD, 0, 0, channel);
+            EV_SET(&eio->events[i], fd, EVFILT_READ, action, 0, 0, channel);
             flag |= FD_MASK_READ;
         }
         if (!(flag & FD_MASK_WRITE) && (mask & FD_MASK_WRITE) && (eio->events[i].ident == -1)) {
-            EV_SET(&eio->events[i], fd, EVFILT_WRITE, EV_ADD, 0, 0, channel);
+            EV_SET(&eio->events[i], fd, EVFILT_WRITE, action, 0, 0, channel);
             flag |= FD_MASK_WRITE;
         }
         if (!(flag & FD_MASK_ERROR) && (mask & FD_MASK_ERROR) && (eio->events[i].ident == -1)) {
-            EV_SET(&eio->events[i], fd, EVFILT_EXCEPT, EV_ADD, 0, 0, channel);
+            EV_SET(&eio->events[i], fd, EVFILT_EXCEPT, action, 0, 0, channel);
             flag |= FD_MASK_ERROR;
         }
         if (flag == mask) break;
@@ -83,14 +91,17 @@ event_io_add_fd(struct event_io *eio, struct event_channel *channel)
     if (kevent(eio->kqfd, eio->events, FD_SETSIZE, NULL, 0, NULL) == -1) {
         return -1;
     }
+
+    /* the loop dispatches only interests still in io_mask */
+    event_channel_set_io_mask(channel, event_channel_get_io_mask(channel) | event_channel_get_mask(channel));
     return 0;
 }
 
-int 
-event_io_remove_fd(struct event_io *eio, struct event_channel *channel)
+static int
+_remove_fd(struct event_io_backend *eio, struct event_channel *channel)
 {
     int fd = event_channel_get_fd(channel);
-    int mask = event_channel_get_mask(channel);
+    int mask = event_channel_get_mask(channel) & FD_MASK_IO;
     int flag = 0;
 
     for (int i = 0; i < FD_SETSIZE; i++) {
@@ -119,52 +130,50 @@ event_io_remove_fd(struct event_io *eio, struct event_channel *channel)
         }
         if (flag == mask) break;
     }
+
+    event_channel_set_io_mask(channel, event_channel_get_io_mask(channel) & ~mask);
+    if ((event_channel_get_io_mask(channel) & FD_MASK_IO) == FD_MASK_NONE)
+        event_channel_set_io_mask(channel, FD_MASK_NONE);
     return 0;
 }
 
-int 
-event_io_poll(struct event_io *eio, struct event_channel_map *ec_map, unsigned long long timeout)
+static int
+_poll(struct event_io_backend *eio, struct event_io_event *events, int max_events, unsigned long long timeout)
 {
-    int ret = 0;
     int n = 0;
+    struct timespec ts = {timeout / 1000000, (timeout % 1000000) * 1000};
 
-    if (event_channel_map_get_length(ec_map) == 0)
-        return 0;
-
-    struct kevent events[FD_SETSIZE];
-    struct timespec ts = {timeout / 1000, (timeout % 1000) * 1000 * 1000};
-    n = kevent(eio->kqfd, NULL, 0, events, FD_SETSIZE, &ts);
-    if (n < 0) {
-        ret = -1;
-        goto EXIT;
-    }
+    if (max_events > FD_SETSIZE)    max_events = FD_SETSIZE;
+    n = kevent(eio->kqfd, NULL, 0, eio->events_back, max_events
+            , timeout == EVENT_IO_TIMEOUT_INFINITE ? NULL : &ts);
+    if (n < 0)
+        return -1;
 
     for (int i = 0; i < n; i++) {
-        struct event_channel *channel = events[i].udata;
-        int fd = event_channel_get_fd(channel);
-
-        if (events[i].flags & EV_ERROR) {
-            event_channel_on_error(channel);
-            continue;
-        }
-        if (events[i].flags & EV_EOF) {
-            event_channel_on_close(channel);
-            continue;
-        }
-        if (events[i].filter == EVFILT_READ) {
-            event_channel_on_read(channel);
-            continue;
-        }
-        if (events[i].filter == EVFILT_WRITE) {
-            event_channel_on_write(channel);
-            continue;
-        }
-        if (events[i].filter == EVFILT_EXCEPT) {
-            event_channel_on_error(channel);
-            continue;
-        }
+        struct kevent *event = &eio->events_back[i];
+        struct event_channel *channel = event->udata;
+        int mask = FD_MASK_NONE;
+
+        if (event->flags & EV_ERROR)                mask = FD_MASK_ERROR;
+        else if (event->flags & EV_EOF)             mask = FD_MASK_CLOSE;
+        else if (event->filter == EVFILT_READ)      mask = FD_MASK_READ;
+        else if (event->filter == EVFILT_WRITE)     mask = FD_MASK_WRITE;
+        else if (event->filter == EVFILT_EXCEPT)    mask = FD_MASK_ERROR;
+
+        events[i].fd = (int) event->ident;
+        events[i].mask = (enum fd_mask) mask;
+        events[i].channel = channel;
     }
 
-EXIT:
-    return ret;
-}
\ No newline at end of file
+    return n;
+}
+
+const struct event_io_ops event_io_kqueue_ops = {
+    .name = "kqueue",
+    .create = _create,
+    .destroy = _delete,
+    .get_features = _get_features,
+    .add_fd = _add_fd,
+    .remove_fd = _remove_fd,
+    .poll = _poll,
+};
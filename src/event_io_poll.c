@@ -0,0 +1,208 @@
+/*
+ * event io poll implementation
+ *
+ * Copyright (c) 2024 kyleliu <justfavme at gmail dot com>
+ * All rights reserved.
+ *
+ * This file is part of Eloop.
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+/* ppoll */
+#define _GNU_SOURCE
+#endif
+
+#include <poll.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "event_io.h"
+#include "event_channel.h"
+
+#define POLL_SLOT_NONE  -1
+
+/*
+ * pollfds and channels are contiguous and parallel, every channel keeps its
+ * slot in io_index, removing swaps the last slot into the hole.
+ */
+struct event_io_backend {
+    struct pollfd *pollfds;
+    struct event_channel **channels;
+    int count;
+    int capacity;
+};
+
+static short
+_mask_2_events(int mask)
+{
+    short events = 0;
+
+    if (mask & FD_MASK_READ)    events |= POLLIN;
+    if (mask & FD_MASK_WRITE)   events |= POLLOUT;
+    if (mask & FD_MASK_ERROR)   events |= POLLPRI;
+    return events;
+}
+
+static int
+_expand(struct event_io_backend *eio)
+{
+    int capacity = eio->capacity ? eio->capacity * 2 : 64;
+    struct pollfd *pollfds = realloc(eio->pollfds, capacity * sizeof(*pollfds));
+    struct event_channel **channels;
+
+    if (!pollfds)   return -1;
+    eio->pollfds = pollfds;
+
+    channels = realloc(eio->channels, capacity * sizeof(*channels));
+    if (!channels)  return -1;
+    eio->channels = channels;
+
+    eio->capacity = capacity;
+    return 0;
+}
+
+static int
+_update(struct event_io_backend *eio, struct event_channel *channel, int old_mask, int new_mask)
+{
+    int slot = event_channel_get_io_index(channel);
+
+    /* edge flag alone is not an interest */
+    if ((new_mask & FD_MASK_IO) == FD_MASK_NONE)
+        new_mask = FD_MASK_NONE;
+    if (old_mask == new_mask)
+        return 0;
+
+    if (old_mask == FD_MASK_NONE) {
+        /* append */
+        if (eio->count == eio->capacity && _expand(eio) != 0)
+            return -1;
+        slot = eio->count++;
+        eio->channels[slot] = channel;
+        eio->pollfds[slot].fd = event_channel_get_fd(channel);
+        eio->pollfds[slot].revents = 0;
+        event_channel_set_io_index(channel, slot);
+    } else if (new_mask == FD_MASK_NONE) {
+        /* swap with last */
+        int last = --eio->count;
+
+        if (slot != last) {
+            eio->pollfds[slot] = eio->pollfds[last];
+            eio->channels[slot] = eio->channels[last];
+            event_channel_set_io_index(eio->channels[slot], slot);
+        }
+        event_channel_set_io_index(channel, POLL_SLOT_NONE);
+        event_channel_set_io_mask(channel, new_mask);
+        return 0;
+    }
+
+    eio->pollfds[slot].events = _mask_2_events(new_mask);
+    event_channel_set_io_mask(channel, new_mask);
+    return 0;
+}
+
+static void _delete(struct event_io_backend **eiop);
+
+static struct event_io_backend *
+_create(void)
+{
+    struct event_io_backend *eio = (struct event_io_backend *) calloc(1, sizeof(*eio));
+    if (!eio) goto FAIL;
+
+    if (_expand(eio) != 0) goto FAIL;
+
+    goto EXIT;
+FAIL:
+    _delete(&eio);
+EXIT:
+    return eio;
+}
+
+static void
+_delete(struct event_io_backend **eiop)
+{
+    struct event_io_backend *eio = eiop && (*eiop) ? (*eiop) : NULL;
+    if (!eio) return;
+    free(eio->pollfds);
+    free(eio->channels);
+    free(eio);
+    *eiop = NULL;
+}
+
+static int
+_get_features(struct event_io_backend *eio)
+{
+    return 0;
+}
+
+static int
+_add_fd(struct event_io_backend *eio, struct event_channel *channel)
+{
+    int io_mask = event_channel_get_io_mask(channel);
+
+    return _update(eio, channel, io_mask, io_mask | event_channel_get_mask(channel));
+}
+
+static int
+_remove_fd(struct event_io_backend *eio, struct event_channel *channel)
+{
+    int io_mask = event_channel_get_io_mask(channel);
+
+    return _update(eio, channel, io_mask, io_mask & ~event_channel_get_mask(channel));
+}
+
+static int
+_poll(struct event_io_backend *eio, struct event_io_event *events, int max_events, unsigned long long timeout)
+{
+    int ret = 0;
+    int n;
+
+#if defined(__linux__)
+    struct timespec ts = {timeout / 1000000, (timeout % 1000000) * 1000};
+
+    n = ppoll(eio->pollfds, (nfds_t) eio->count, timeout == EVENT_IO_TIMEOUT_INFINITE ? NULL : &ts, NULL);
+#else
+    /* round up, waking before the deadline only spins */
+    n = poll(eio->pollfds, (nfds_t) eio->count, timeout == EVENT_IO_TIMEOUT_INFINITE ? -1 
+            : (int) ((timeout + 999) / 1000 > 0x7fffffff ? 0x7fffffff : (timeout + 999) / 1000));
+#endif
+    if (n < 0)
+        return errno == EINTR ? 0 : -1;
+
+    for (int i = 0; i < eio->count && ret < n && ret < max_events; i++) {
+        short revents = eio->pollfds[i].revents;
+        int io_mask = event_channel_get_io_mask(eio->channels[i]);
+        int mask = FD_MASK_NONE;
+
+        if (revents == 0)
+            continue;
+
+        /* error and hangup are reported by read or write */
+        if (revents & (POLLERR | POLLHUP | POLLNVAL)) {
+            if (io_mask & FD_MASK_READ)         revents |= POLLIN;
+            else if (io_mask & FD_MASK_WRITE)   revents |= POLLOUT;
+        }
+        if (revents & POLLIN)   mask |= FD_MASK_READ;
+        if (revents & POLLOUT)  mask |= FD_MASK_WRITE;
+        if (revents & POLLPRI)  mask |= FD_MASK_ERROR;
+
+        events[ret].fd = eio->pollfds[i].fd;
+        events[ret].mask = (enum fd_mask) mask;
+        events[ret].channel = eio->channels[i];
+        ret++;
+    }
+
+    return ret;
+}
+
+const struct event_io_ops event_io_poll_ops = {
+    .name = "poll",
+    .create = _create,
+    .destroy = _delete,
+    .get_features = _get_features,
+    .add_fd = _add_fd,
+    .remove_fd = _remove_fd,
+    .poll = _poll,
+};
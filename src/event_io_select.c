@@ -9,6 +9,7 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
 
 #if defined(__linux) || defined(__linux__) 
 #include <sys/select.h>
@@ -29,10 +30,20 @@
 
 #include "event_io.h"
 #include "event_channel.h"
-#include "event_channel_map.h"
 #include "common/list.h"
 
-struct event_io {
+#define SELECT_SLOT_NONE    -1
+
+/*
+ * fd_set can not be iterated, registered channels are kept in a contiguous
+ * array too, every channel keeps its slot in io_index.
+ */
+struct event_io_backend {
+    struct event_channel **channels;
+    int count;
+    int capacity;
+
+
     fd_set fds_read;
     fd_set fds_write;
     fd_set fds_exp;
@@ -45,12 +56,73 @@ struct event_io {
     char fds_is_dirty;
 };
 
-struct event_io *
-event_io_create(void)
+static int
+_expand(struct event_io_backend *eio)
+{
+    int capacity = eio->capacity ? eio->capacity * 2 : 64;
+    struct event_channel **channels = realloc(eio->channels, capacity * sizeof(*channels));
+
+    if (!channels)  return -1;
+    eio->channels = channels;
+    eio->capacity = capacity;
+    return 0;
+}
+
+static void
+_fd_update(fd_set *fds, int fd, int old_mask, int new_mask, int mask)
+{
+    if (!(old_mask & mask) && (new_mask & mask))        FD_SET(fd, fds);
+    else if ((old_mask & mask) && !(new_mask & mask))   FD_CLR(fd, fds);
+}
+
+static int
+_update(struct event_io_backend *eio, struct event_channel *channel, int old_mask, int new_mask)
+{
+    int fd = event_channel_get_fd(channel);
+    int slot = event_channel_get_io_index(channel);
+
+    /* edge flag alone is not an interest */
+    if ((new_mask & FD_MASK_IO) == FD_MASK_NONE)
+        new_mask = FD_MASK_NONE;
+    if (old_mask == new_mask)
+        return 0;
+
+    if (old_mask == FD_MASK_NONE) {
+        /* append */
+        if (eio->count == eio->capacity && _expand(eio) != 0)
+            return -1;
+        slot = eio->count++;
+        eio->channels[slot] = channel;
+        event_channel_set_io_index(channel, slot);
+    } else if (new_mask == FD_MASK_NONE) {
+        /* swap with last */
+        int last = --eio->count;
+
+        if (slot != last) {
+            eio->channels[slot] = eio->channels[last];
+            event_channel_set_io_index(eio->channels[slot], slot);
+        }
+        event_channel_set_io_index(channel, SELECT_SLOT_NONE);
+    }
+
+    _fd_update(&eio->fds_read, fd, old_mask, new_mask, FD_MASK_READ);
+    _fd_update(&eio->fds_write, fd, old_mask, new_mask, FD_MASK_WRITE);
+    _fd_update(&eio->fds_exp, fd, old_mask, new_mask, FD_MASK_ERROR);
+
+    event_channel_set_io_mask(channel, new_mask);
+    eio->fds_is_dirty = 1;
+    return 0;
+}
+
+static void _delete(struct event_io_backend **eiop);
+
+static struct event_io_backend *
+_create(void)
 {
-    struct event_io *eio = (struct event_io *) calloc(1, sizeof(*eio));
+    struct event_io_backend *eio = (struct event_io_backend *) calloc(1, sizeof(*eio));
 
     if (eio == NULL)            goto FAIL;
+    if (_expand(eio) != 0)      goto FAIL;
 
     FD_ZERO(&eio->fds_read);
     FD_ZERO(&eio->fds_write);
@@ -65,51 +137,59 @@ event_io_create(void)
 
     goto EXIT;
 FAIL:
-    event_io_delete(&eio);
+    _delete(&eio);
 EXIT:
     return eio;
 }
 
-void 
-event_io_delete(struct event_io **eiop)
+static void
+_delete(struct event_io_backend **eiop)
 {
-    struct event_io *eio = eiop && (*eiop) ? (*eiop) : NULL;
+    struct event_io_backend *eio = eiop && (*eiop) ? (*eiop) : NULL;
     if (!eio)   return;
 
+    free(eio->channels);
     free(eio);
     *eiop = NULL;
 }
 
-int 
-event_io_add_fd(struct event_io *eio, struct event_channel *channel)
+static int
+_get_features(struct event_io_backend *eio)
 {
-    if (event_channel_is_exist_mask(channel, FD_MASK_READ))    FD_SET(event_channel_get_fd(channel), &eio->fds_read);
-    if (event_channel_is_exist_mask(channel, FD_MASK_WRITE))   FD_SET(event_channel_get_fd(channel), &eio->fds_write);
-    if (event_channel_is_exist_mask(channel, FD_MASK_ERROR))   FD_SET(event_channel_get_fd(channel), &eio->fds_exp);
-
-    eio->fds_is_dirty = 1;
     return 0;
 }
 
-int 
-event_io_remove_fd(struct event_io *eio, struct event_channel *channel)
+static int
+_add_fd(struct event_io_backend *eio, struct event_channel *channel)
 {
-    if (event_channel_is_exist_mask(channel, FD_MASK_READ))    FD_CLR(event_channel_get_fd(channel), &eio->fds_read);
-    if (event_channel_is_exist_mask(channel, FD_MASK_WRITE))   FD_CLR(event_channel_get_fd(channel), &eio->fds_write);
-    if (event_channel_is_exist_mask(channel, FD_MASK_ERROR))   FD_CLR(event_channel_get_fd(channel), &eio->fds_exp);
+    int io_mask = event_channel_get_io_mask(channel);
 
-    eio->fds_is_dirty = 1;
-    return 0;
+#if !defined(WIN32) && !defined(_WIN32)
+    /* FD_SET overflows fd_set, use poll backend for large fd */
+    if (event_channel_get_fd(channel) >= FD_SETSIZE)
+        return -1;
+#endif
+
+    return _update(eio, channel, io_mask, io_mask | event_channel_get_mask(channel));
 }
 
-int 
-event_io_poll(struct event_io *eio, struct event_channel_map *ec_map, unsigned long long timeout)
+static int
+_remove_fd(struct event_io_backend *eio, struct event_channel *channel)
+{
+    int io_mask = event_channel_get_io_mask(channel);
+
+    return _update(eio, channel, io_mask, io_mask & ~event_channel_get_mask(channel));
+}
+
+static int
+_poll(struct event_io_backend *eio, struct event_io_event *events, int max_events, unsigned long long timeout)
 {
     int ret = 0;
-    int live_count = 0;
-    struct timeval tv = {timeout / 1000, (timeout % 1000) * 1000};
+    int event_count = 0;
+    struct timeval tv = {timeout / 1000000, timeout % 1000000};
 
-    if (event_channel_map_get_length(ec_map) == 0)
+    /* select on empty sets fails on windows */
+    if (eio->count == 0)
         return 0;
 
     FD_ZERO(&eio->fds_read_back);
@@ -124,14 +204,19 @@ event_io_poll(struct event_io *eio, struct event_channel_map *ec_map, unsigned l
     /* 1. find max fd and use back fd to select */
     if (eio->fds_is_dirty) {
         eio->fds_is_dirty = 0;
-        eio->max_fd = event_channel_map_get_max_fd(ec_map);
+        eio->max_fd = -1;
+        for (int i = 0; i < eio->count; i++) {
+            int fd = event_channel_get_fd(eio->channels[i]);
+            if (fd > eio->max_fd)   eio->max_fd = fd;
+        }
 #if 0
         printf("%s>%d>max_fd=%d\n", __FUNCTION__, __LINE__, eio->max_fd);
 #endif
     }
 
     /* 2. select */
-    ret = select(eio->max_fd + 1, &eio->fds_read_back, &eio->fds_write_back, &eio->fds_exp_back, &tv);
+    ret = select(eio->max_fd + 1, &eio->fds_read_back, &eio->fds_write_back, &eio->fds_exp_back
+            , timeout == EVENT_IO_TIMEOUT_INFINITE ? NULL : &tv);
     if (ret < 0) {
 #if defined(__linux) || defined(__linux__)
         if(errno == EINTR)
@@ -147,31 +232,33 @@ event_io_poll(struct event_io *eio, struct event_channel_map *ec_map, unsigned l
     }
 
     /* 3. fill */
-    if (ret > 0) {
-        int event_ret = 0;
-        void *meta = NULL;
-
-        for (struct event_channel *channel = event_channel_map_get_head(ec_map, &meta)
-            ; channel != NULL && meta != NULL
-            ; /**/) {
-            int fd = event_channel_get_fd(channel);
-            struct event_channel *channel_next = event_channel_map_get_next(ec_map, &meta);
-
-#if 0
-            printf("%s>%d>fd=%d, ret=%d, r=%d, w=%d, e=%d\n", __FUNCTION__, __LINE__, fd, ret
-                    , FD_ISSET(fd, &eio->fds_read_back)
-                    , FD_ISSET(fd, &eio->fds_write_back)
-                    , FD_ISSET(fd, &eio->fds_exp_back));
-#endif
-            if (FD_ISSET(fd, &eio->fds_read_back))     event_ret = event_channel_on_read(channel);
-            if (FD_ISSET(fd, &eio->fds_write_back))    event_ret = event_channel_on_write(channel);
-            if (FD_ISSET(fd, &eio->fds_exp_back))      event_ret = event_channel_on_error(channel);
-
-            live_count++;
-
-            channel = channel_next;
-        }
+    for (int i = 0; i < eio->count && ret > 0 && event_count < max_events; i++) {
+        struct event_channel *channel = eio->channels[i];
+        int fd = event_channel_get_fd(channel);
+        int mask = FD_MASK_NONE;
+
+        if (FD_ISSET(fd, &eio->fds_read_back))     mask |= FD_MASK_READ;
+        if (FD_ISSET(fd, &eio->fds_write_back))    mask |= FD_MASK_WRITE;
+        if (FD_ISSET(fd, &eio->fds_exp_back))      mask |= FD_MASK_ERROR;
+        if (mask == FD_MASK_NONE)
+            continue;
+
+        events[event_count].fd = fd;
+        events[event_count].mask = (enum fd_mask) mask;
+        events[event_count].channel = channel;
+        event_count++;
+        ret--;
     }
 
-    return live_count;
+    return event_count;
 }
+
+const struct event_io_ops event_io_select_ops = {
+    .name = "select",
+    .create = _create,
+    .destroy = _delete,
+    .get_features = _get_features,
+    .add_fd = _add_fd,
+    .remove_fd = _remove_fd,
+    .poll = _poll,
+};
@@ -0,0 +1,622 @@
+/*
+ * event io io_uring implementation
+ *
+ * Copyright (c) 2024 kyleliu <justfavme at gmail dot com>
+ * All rights reserved.
+ *
+ * This file is part of Eloop.
+ */
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "event_io.h"
+#include "event_channel.h"
+
+#define URING_ENTRIES       4096
+#define URING_SLOT_NONE     -1
+#define URING_USER_IGNORE   0xffffffffffffffffULL
+#define URING_USER_RECV     0x80000000U
+#define URING_BUF_GROUP     0
+#define URING_BUF_COUNT     256
+#define URING_BUF_LENGTH    4096
+
+/*
+ * Every registered channel owns a slot, user_data of a request is
+ * (generation << 32 | kind | slot), generation changes when the request is
+ * re-armed, cancelled or the slot is released, so completions of stale 
+ * requests are dropped.
+ */
+struct uring_slot {
+    struct event_channel *channel;
+    unsigned int gen;
+    unsigned int recv_gen;
+    /* recv stopped on an empty buffer ring, armed again after a full harvest */
+    int is_starved;
+    int next_free;
+};
+
+struct event_io_backend {
+    int ring_fd;
+
+    /* submission queue */
+    void *sq_ptr;
+    size_t sq_length;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int sq_entries;
+    unsigned int sq_local_tail;
+    struct io_uring_sqe *sqes;
+    size_t sqes_length;
+
+    /* completion queue */
+    void *cq_ptr;
+    size_t cq_length;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /* slots */
+    struct uring_slot *slots;
+    int slot_count;
+    int slot_free;
+
+    /* provided buffer ring for FD_MASK_RECV */
+    struct io_uring_buf_ring *buf_ring;
+    char *buf_base;
+    unsigned short buf_tail;
+    int starved_count;
+    /* multishot recv needs 6.0, older kernels fail it with EINVAL */
+    int is_recv_single;
+
+    /* output of the current poll */
+    struct event_io_event *events;
+    int event_max;
+    int event_count;
+};
+
+static int
+_uring_setup(unsigned int entries, struct io_uring_params *params)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int
+_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags, void *arg, size_t arg_length)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_length);
+}
+
+static unsigned int
+_sq_pending(struct event_io_backend *eio)
+{
+    return eio->sq_local_tail - __atomic_load_n(eio->sq_head, __ATOMIC_ACQUIRE);
+}
+
+static int
+_submit(struct event_io_backend *eio)
+{
+    int ret;
+
+    __atomic_store_n(eio->sq_tail, eio->sq_local_tail, __ATOMIC_RELEASE);
+    do {
+        ret = _uring_enter(eio->ring_fd, _sq_pending(eio), 0, 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret < 0 ? -1 : 0;
+}
+
+static struct io_uring_sqe *
+_get_sqe(struct event_io_backend *eio)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int index;
+
+    /* full, submit the batch now */
+    if (_sq_pending(eio) >= eio->sq_entries && _submit(eio) != 0)
+        return NULL;
+
+    index = eio->sq_local_tail & *eio->sq_mask;
+    eio->sq_array[index] = index;
+    eio->sq_local_tail++;
+
+    sqe = &eio->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static unsigned long long
+_user_data(unsigned int gen, int slot, unsigned int kind)
+{
+    return ((unsigned long long) gen << 32) | kind | (unsigned int) slot;
+}
+
+static int
+_is_recv(struct event_io_backend *eio, int mask)
+{
+    return eio->buf_ring && (mask & FD_MASK_READ) && (mask & FD_MASK_RECV);
+}
+
+/* interest served by poll, read goes to recv in completion mode */
+static int
+_poll_mask(struct event_io_backend *eio, int mask)
+{
+    if (_is_recv(eio, mask))
+        mask &= ~FD_MASK_READ;
+    return (mask & FD_MASK_IO) ? mask : FD_MASK_NONE;
+}
+
+static void
+_buf_recycle(struct event_io_backend *eio, unsigned short bid)
+{
+    struct io_uring_buf *buf = &eio->buf_ring->bufs[eio->buf_tail & (URING_BUF_COUNT - 1)];
+
+    buf->addr = (unsigned long long) (uintptr_t) (eio->buf_base + (size_t) bid * URING_BUF_LENGTH);
+    buf->len = URING_BUF_LENGTH;
+    buf->bid = bid;
+    eio->buf_tail++;
+    __atomic_store_n(&eio->buf_ring->tail, eio->buf_tail, __ATOMIC_RELEASE);
+}
+
+static int
+_buf_ring_create(struct event_io_backend *eio)
+{
+    struct io_uring_buf_reg reg = {0};
+    size_t ring_length = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    void *ring = mmap(NULL, ring_length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (ring == MAP_FAILED)
+        return -1;
+
+    eio->buf_base = (char *) malloc((size_t) URING_BUF_COUNT * URING_BUF_LENGTH);
+    reg.ring_addr = (unsigned long long) (uintptr_t) ring;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BUF_GROUP;
+    if (!eio->buf_base || syscall(__NR_io_uring_register, eio->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        free(eio->buf_base);
+        eio->buf_base = NULL;
+        munmap(ring, ring_length);
+        return -1;
+    }
+
+    eio->buf_ring = (struct io_uring_buf_ring *) ring;
+    for (int i = 0; i < URING_BUF_COUNT; i++)
+        _buf_recycle(eio, (unsigned short) i);
+    return 0;
+}
+
+static int
+_slot_alloc(struct event_io_backend *eio, struct event_channel *channel)
+{
+    int slot;
+
+    if (eio->slot_free == URING_SLOT_NONE) {
+        int count = eio->slot_count ? eio->slot_count * 2 : 64;
+        struct uring_slot *slots = realloc(eio->slots, count * sizeof(*slots));
+
+        if (!slots)     return URING_SLOT_NONE;
+        for (int i = eio->slot_count; i < count; i++) {
+            slots[i].channel = NULL;
+            slots[i].gen = 0;
+            slots[i].recv_gen = 0;
+            slots[i].is_starved = 0;
+            slots[i].next_free = i + 1 < count ? i + 1 : URING_SLOT_NONE;
+        }
+        eio->slots = slots;
+        eio->slot_free = eio->slot_count;
+        eio->slot_count = count;
+    }
+
+    slot = eio->slot_free;
+    eio->slot_free = eio->slots[slot].next_free;
+    eio->slots[slot].channel = channel;
+    return slot;
+}
+
+static void
+_starved_clear(struct event_io_backend *eio, int slot)
+{
+    if (eio->slots[slot].is_starved) {
+        eio->slots[slot].is_starved = 0;
+        eio->starved_count--;
+    }
+}
+
+static void
+_slot_free(struct event_io_backend *eio, int slot)
+{
+    _starved_clear(eio, slot);
+    eio->slots[slot].channel = NULL;
+    eio->slots[slot].gen++;
+    eio->slots[slot].next_free = eio->slot_free;
+    eio->slot_free = slot;
+}
+
+static int
+_poll_cancel(struct event_io_backend *eio, int slot)
+{
+    struct io_uring_sqe *sqe = _get_sqe(eio);
+
+    if (!sqe)   return -1;
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = _user_data(eio->slots[slot].gen++, slot, 0);
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->user_data = URING_USER_IGNORE;
+    return 0;
+}
+
+static int
+_recv_cancel(struct event_io_backend *eio, int slot)
+{
+    struct io_uring_sqe *sqe = _get_sqe(eio);
+
+    if (!sqe)   return -1;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = _user_data(eio->slots[slot].recv_gen++, slot, URING_USER_RECV);
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->user_data = URING_USER_IGNORE;
+    return 0;
+}
+
+/* multishot recv, kernel picks a buffer of the provided ring per completion */
+static int
+_recv_arm(struct event_io_backend *eio, int slot)
+{
+    struct io_uring_sqe *sqe = _get_sqe(eio);
+
+    if (!sqe)   return -1;
+    eio->slots[slot].recv_gen++;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = event_channel_get_fd(eio->slots[slot].channel);
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->ioprio = eio->is_recv_single ? 0 : IORING_RECV_MULTISHOT;
+    sqe->user_data = _user_data(eio->slots[slot].recv_gen, slot, URING_USER_RECV);
+    return 0;
+}
+
+/* level channels use one-shot poll re-armed per completion, edge channels stay multishot */
+static int
+_poll_arm(struct event_io_backend *eio, int slot, int mask)
+{
+    struct io_uring_sqe *sqe = _get_sqe(eio);
+    unsigned int events = 0;
+
+    if (!sqe)   return -1;
+    if (mask & FD_MASK_READ)    events |= POLLIN;
+    if (mask & FD_MASK_WRITE)   events |= POLLOUT;
+    if (mask & FD_MASK_ERROR)   events |= POLLPRI;
+
+    eio->slots[slot].gen++;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = event_channel_get_fd(eio->slots[slot].channel);
+    sqe->poll32_events = events;
+    sqe->len = (mask & FD_MASK_EDGE) ? IORING_POLL_ADD_MULTI : 0;
+    sqe->user_data = _user_data(eio->slots[slot].gen, slot, 0);
+    return 0;
+}
+
+static int
+_update(struct event_io_backend *eio, struct event_channel *channel, int old_mask, int new_mask)
+{
+    int slot = event_channel_get_io_index(channel);
+    int old_poll, new_poll;
+
+    /* edge flag alone is not an interest */
+    if ((new_mask & FD_MASK_IO) == FD_MASK_NONE)
+        new_mask = FD_MASK_NONE;
+    if (old_mask == new_mask)
+        return 0;
+
+    if (old_mask == FD_MASK_NONE) {
+        slot = _slot_alloc(eio, channel);
+        if (slot == URING_SLOT_NONE)
+            return -1;
+        event_channel_set_io_index(channel, slot);
+    }
+
+    /* poll */
+    old_poll = _poll_mask(eio, old_mask);
+    new_poll = _poll_mask(eio, new_mask);
+    if (old_poll != new_poll) {
+        if (old_poll != FD_MASK_NONE)
+            _poll_cancel(eio, slot);
+        if (new_poll != FD_MASK_NONE && _poll_arm(eio, slot, new_poll) != 0)
+            return -1;
+    }
+
+    /* recv */
+    if (_is_recv(eio, old_mask) != _is_recv(eio, new_mask)) {
+        if (_is_recv(eio, old_mask)) {
+            _starved_clear(eio, slot);
+            _recv_cancel(eio, slot);
+        } else if (_recv_arm(eio, slot) != 0)
+            return -1;
+    }
+
+    if (new_mask == FD_MASK_NONE) {
+        _slot_free(eio, slot);
+        event_channel_set_io_index(channel, URING_SLOT_NONE);
+    }
+
+    event_channel_set_io_mask(channel, new_mask);
+    return 0;
+}
+
+static void
+_event_add(struct event_io_backend *eio, struct event_channel *channel, int mask)
+{
+    struct event_io_event *event = &eio->events[eio->event_count++];
+
+    event->fd = event_channel_get_fd(channel);
+    event->mask = (enum fd_mask) mask;
+    event->channel = channel;
+}
+
+static int
+_revents_2_mask(unsigned int revents, int io_mask)
+{
+    int mask = FD_MASK_NONE;
+
+    /* error and hangup are reported by read or write */
+    if (revents & (POLLERR | POLLHUP)) {
+        if (io_mask & FD_MASK_READ)         revents |= POLLIN;
+        else if (io_mask & FD_MASK_WRITE)   revents |= POLLOUT;
+    }
+    if (revents & POLLIN)   mask |= FD_MASK_READ;
+    if (revents & POLLOUT)  mask |= FD_MASK_WRITE;
+    if (revents & POLLPRI)  mask |= FD_MASK_ERROR;
+    return mask;
+}
+
+/* 
+ * copy received buffer to recv pipe, so the ring buffer goes back at once,
+ * eof and error close the channel.
+ */
+static void
+_harvest_recv(struct event_io_backend *eio, struct io_uring_cqe *cqe, int slot)
+{
+    struct event_channel *channel = eio->slots[slot].channel;
+
+    if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+        unsigned short bid = (unsigned short) (cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        char *data = eio->buf_base + (size_t) bid * URING_BUF_LENGTH;
+        int ret = buffer_pipe_write(event_channel_get_recv_pipe(channel), data, (size_t) cqe->res);
+
+        _event_add(eio, channel, ret == 0 ? FD_MASK_READ : FD_MASK_CLOSE);
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+            _recv_arm(eio, slot);
+    } else if (cqe->res == -EINVAL && !eio->is_recv_single) {
+        /* kernel without multishot recv, one-shot from now on */
+        eio->is_recv_single = 1;
+        _recv_arm(eio, slot);
+    } else if (cqe->res == -ENOBUFS) {
+        /* buffers come back as their completions are harvested, retry after that */
+        if (!eio->slots[slot].is_starved) {
+            eio->slots[slot].is_starved = 1;
+            eio->starved_count++;
+        }
+    } else {
+        _event_add(eio, channel, FD_MASK_CLOSE);
+    }
+}
+
+static void
+_harvest_starved(struct event_io_backend *eio)
+{
+    for (int slot = 0; slot < eio->slot_count && eio->starved_count > 0; slot++) {
+        if (!eio->slots[slot].is_starved)
+            continue;
+        if (_recv_arm(eio, slot) != 0)
+            break;
+        _starved_clear(eio, slot);
+    }
+}
+
+static int
+_harvest(struct event_io_backend *eio, struct event_io_event *events, int max_events)
+{
+    unsigned int head = *eio->cq_head;
+    unsigned int tail = __atomic_load_n(eio->cq_tail, __ATOMIC_ACQUIRE);
+
+    eio->events = events;
+    eio->event_max = max_events;
+    eio->event_count = 0;
+
+    for (/**/; head != tail && eio->event_count < eio->event_max; head++) {
+        struct io_uring_cqe *cqe = &eio->cqes[head & *eio->cq_mask];
+        int slot = (int) (cqe->user_data & ~URING_USER_RECV & 0xffffffff);
+        unsigned int gen = (unsigned int) (cqe->user_data >> 32);
+        struct event_channel *channel;
+        int io_mask;
+
+        if (cqe->user_data == URING_USER_IGNORE)
+            continue;
+
+        if (cqe->user_data & URING_USER_RECV) {
+            /* the buffer goes back to the ring whether the completion is stale or not */
+            if (slot < eio->slot_count && eio->slots[slot].channel && eio->slots[slot].recv_gen == gen)
+                _harvest_recv(eio, cqe, slot);
+            if (cqe->flags & IORING_CQE_F_BUFFER)
+                _buf_recycle(eio, (unsigned short) (cqe->flags >> IORING_CQE_BUFFER_SHIFT));
+            continue;
+        }
+
+        if (slot >= eio->slot_count || !eio->slots[slot].channel)
+            continue;
+        channel = eio->slots[slot].channel;
+        io_mask = event_channel_get_io_mask(channel);
+        if (eio->slots[slot].gen != gen)
+            continue;
+
+        /* failed request is reported as error and not armed again */
+        _event_add(eio, channel, _revents_2_mask(cqe->res < 0 ? POLLERR : (unsigned int) cqe->res, io_mask));
+
+        /* one-shot or terminated multishot, arm again */
+        if (cqe->res >= 0 && !(cqe->flags & IORING_CQE_F_MORE))
+            _poll_arm(eio, slot, _poll_mask(eio, io_mask));
+    }
+
+    __atomic_store_n(eio->cq_head, head, __ATOMIC_RELEASE);
+
+    /* every completed buffer is back once the queue is drained */
+    if (eio->starved_count > 0 && head == tail)
+        _harvest_starved(eio);
+    return eio->event_count;
+}
+
+static void _delete(struct event_io_backend **eiop);
+
+static struct event_io_backend *
+_create(void)
+{
+    struct io_uring_params params = {0};
+    struct event_io_backend *eio = (struct event_io_backend *) calloc(1, sizeof(*eio));
+    if (!eio) goto FAIL;
+
+    eio->slot_free = URING_SLOT_NONE;
+    eio->ring_fd = _uring_setup(URING_ENTRIES, &params);
+    if (eio->ring_fd == -1) goto FAIL;
+
+    /* timeout of io_uring_enter and skipping cancel completions */
+    if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_CQE_SKIP))
+        goto FAIL;
+
+    eio->sq_length = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    eio->cq_length = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (eio->cq_length > eio->sq_length)    eio->sq_length = eio->cq_length;
+        eio->cq_length = 0;
+    }
+
+    eio->sq_ptr = mmap(NULL, eio->sq_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, eio->ring_fd, IORING_OFF_SQ_RING);
+    if (eio->sq_ptr == MAP_FAILED) {
+        eio->sq_ptr = NULL;
+        goto FAIL;
+    }
+
+    if (eio->cq_length) {
+        eio->cq_ptr = mmap(NULL, eio->cq_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, eio->ring_fd, IORING_OFF_CQ_RING);
+        if (eio->cq_ptr == MAP_FAILED) {
+            eio->cq_ptr = NULL;
+            goto FAIL;
+        }
+    }
+
+    eio->sqes_length = params.sq_entries * sizeof(struct io_uring_sqe);
+    eio->sqes = mmap(NULL, eio->sqes_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, eio->ring_fd, IORING_OFF_SQES);
+    if (eio->sqes == MAP_FAILED) {
+        eio->sqes = NULL;
+        goto FAIL;
+    }
+
+    eio->sq_head = (unsigned int *) ((char *) eio->sq_ptr + params.sq_off.head);
+    eio->sq_tail = (unsigned int *) ((char *) eio->sq_ptr + params.sq_off.tail);
+    eio->sq_mask = (unsigned int *) ((char *) eio->sq_ptr + params.sq_off.ring_mask);
+    eio->sq_array = (unsigned int *) ((char *) eio->sq_ptr + params.sq_off.array);
+    eio->sq_entries = params.sq_entries;
+    eio->sq_local_tail = *eio->sq_tail;
+
+    {
+        char *cq_ptr = eio->cq_ptr ? (char *) eio->cq_ptr : (char *) eio->sq_ptr;
+
+        eio->cq_head = (unsigned int *) (cq_ptr + params.cq_off.head);
+        eio->cq_tail = (unsigned int *) (cq_ptr + params.cq_off.tail);
+        eio->cq_mask = (unsigned int *) (cq_ptr + params.cq_off.ring_mask);
+        eio->cqes = (struct io_uring_cqe *) (cq_ptr + params.cq_off.cqes);
+    }
+
+    /* optional, without it FD_MASK_RECV falls back to poll */
+    _buf_ring_create(eio);
+
+    goto EXIT;
+FAIL:
+    _delete(&eio);
+EXIT:
+    return eio;
+}
+
+static void
+_delete(struct event_io_backend **eiop)
+{
+    struct event_io_backend *eio = eiop && (*eiop) ? (*eiop) : NULL;
+    if (!eio) return;
+    if (eio->sqes) munmap(eio->sqes, eio->sqes_length);
+    if (eio->cq_ptr) munmap(eio->cq_ptr, eio->cq_length);
+    if (eio->sq_ptr) munmap(eio->sq_ptr, eio->sq_length);
+    if (eio->ring_fd != -1) close(eio->ring_fd);
+    if (eio->buf_ring) munmap(eio->buf_ring, URING_BUF_COUNT * sizeof(struct io_uring_buf));
+    free(eio->buf_base);
+    free(eio->slots);
+    free(eio);
+    *eiop = NULL;
+}
+
+static int
+_get_features(struct event_io_backend *eio)
+{
+    return EVENT_IO_FEATURE_EDGE | (eio->buf_ring ? EVENT_IO_FEATURE_RECV : 0);
+}
+
+static int
+_add_fd(struct event_io_backend *eio, struct event_channel *channel)
+{
+    int io_mask = event_channel_get_io_mask(channel);
+
+    return _update(eio, channel, io_mask, io_mask | event_channel_get_mask(channel));
+}
+
+static int
+_remove_fd(struct event_io_backend *eio, struct event_channel *channel)
+{
+    int io_mask = event_channel_get_io_mask(channel);
+
+    return _update(eio, channel, io_mask, io_mask & ~event_channel_get_mask(channel));
+}
+
+static int
+_poll(struct event_io_backend *eio, struct event_io_event *events, int max_events, unsigned long long timeout)
+{
+    struct __kernel_timespec ts = {timeout / 1000000, (timeout % 1000000) * 1000};
+    struct io_uring_getevents_arg arg = {0};
+
+    /* 1. submit all changes of this iteration and wait in one syscall */
+    if (timeout != EVENT_IO_TIMEOUT_INFINITE)
+        arg.ts = (unsigned long long) (uintptr_t) &ts;
+    __atomic_store_n(eio->sq_tail, eio->sq_local_tail, __ATOMIC_RELEASE);
+    if (*eio->cq_head == __atomic_load_n(eio->cq_tail, __ATOMIC_ACQUIRE)) {
+        if (_uring_enter(eio->ring_fd, _sq_pending(eio), timeout > 0 ? 1 : 0,
+                    IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) < 0) {
+            if (errno != ETIME && errno != EINTR && errno != EBUSY)
+                return -1;
+        }
+    } else if (_sq_pending(eio) > 0) {
+        _submit(eio);
+    }
+
+    /* 2. collect */
+    return _harvest(eio, events, max_events);
+}
+
+const struct event_io_ops event_io_uring_ops = {
+    .name = "uring",
+    .create = _create,
+    .destroy = _delete,
+    .get_features = _get_features,
+    .add_fd = _add_fd,
+    .remove_fd = _remove_fd,
+    .poll = _poll,
+};
@@ -6,121 +6,473 @@
  * This file is part of Eloop.
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+/* pthread_attr_setaffinity_np, pthread_setname_np */
+#define _GNU_SOURCE
+#endif
+
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 
 #include <pthread.h>
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#endif
 
 #include "event_io.h"
 #include "event_loop.h"
 #include "event_channel_map.h"
-#include "common/list.h"
+#include "timer_wheel.h"
+#include "timer_heap.h"
+
+#define FD_EVENTS_MAX   1024
+
+/* without wakeup fd the poll is bounded by this tick */
+#if defined(WIN32) || defined(_WIN32)
+#define FD_TICK_MS      10
+#endif
+
+/* timers live in slab pages, id is generation << 32 | slot */
+#define TIMER_TICK_US   100
+#define TIMER_GEN_MASK  0x3fffffff
+/* ids handed out by other threads, mapped to the slot by the loop */
+#define TIMER_ALIAS_BIT (1LL << 62)
+#define TIMER_PAGE_BITS 8
+#define TIMER_PAGE_SIZE (1 << TIMER_PAGE_BITS)
+
+/* jobs run per iteration unless event_loop_options sets another budget */
+#define JOB_BUDGET_DEFAULT  1024
+
+/* busy share is averaged per window, a longer poll counts as idle */
+#define LOAD_WINDOW_US      (100 * 1000)
+#define LOAD_SCALE          1024
 
 struct event_timer {
+    /* first, the wheel hands it back */
+    struct timer_wheel_node node;
+    /* high resolution timers wait in the heap instead */
+    struct timer_heap_node heap_node;
+    /* 0 when free */
     long long id;
-    unsigned int interval_ms;
+    /* id given to a thread other than the loop, 0 when none */
+    long long alias;
+    unsigned int gen;
+    int next_free;
+    unsigned long long interval_ns;
+    int is_hires;
+    /* nominal deadline and slack, in wheel ticks or nanoseconds */
+    unsigned long long deadline;
+    unsigned long long slack;
     enum timer_type type;
+    enum timer_missed missed;
     event_loop_timer_proc on_timer;
     void *userdata;
-    struct timespec ts;
 };
 
 struct event_job {
+    struct event_job *next;
     event_loop_job_proc on_job;
     void *userdata1;
     void *userdata2;
     void *userdata3;
+    /* runs when the loop drops its jobs, to release what the job owns */
+    event_loop_job_proc on_drop;
+    /* internal command, still applied when the loop drops its jobs */
+    int is_cmd;
 };
 
-struct event_loop {
-    /* timer */
-    long long tid;
+enum event_cmd_type {
+    event_cmd_add_channel,
+    event_cmd_update_channel,
+    event_cmd_remove_channel,
+    event_cmd_remove_fd,
+    event_cmd_add_timer,
+    event_cmd_remove_timer,
+};
 
-    struct list *timer_list;
-    pthread_mutex_t timer_mtx;
+/* operation of another thread, applied by the loop thread */
+struct event_cmd {
+    enum event_cmd_type type;
+    struct event_channel *channel;
+    int fd;
+    int mask;
+    int is_delete;
+    /* template of event_cmd_add_timer */
+    struct event_timer timer;
+    long long id;
 
-    /* job */
-    struct list *job_list;
-    pthread_mutex_t job_mtx;
+    /* the caller waits on cmd_cond, otherwise the loop frees it */
+    int is_sync;
+    int done;
+    long long ret;
+};
 
-    /* fd */
-    pthread_mutex_t fd_mtx;
+struct event_loop {
+    /* timer, slab pages never move so the wheel keeps pointers into them */
+    struct timer_wheel *timer_wheel;
+    struct event_timer **timer_pages;
+    int timer_page_count;
+    int timer_free;
+    /* alias -> slot, open addressing */
+    long long *alias_keys;
+    int *alias_slots;
+    unsigned int alias_size;
+    unsigned int alias_count;
+    long long alias_next;
+
+    /* high resolution timers, timerfd armed at the heap top in nanoseconds */
+    struct timer_heap *timer_heap;
+    int timer_fd;
+    unsigned long long timer_fd_armed;
+    struct event_channel *timer_channel;
+
+    /* clock of the current iteration */
+    unsigned long long now_us;
+
+    /* job, lock-free stack pushed by any thread and taken whole by the loop */
+    struct event_job *job_head;
+    /* FIFO taken from job_head but over the budget, loop thread only */
+    struct event_job *job_backlog;
+    struct event_job *job_backlog_tail;
+    unsigned int job_budget;
+
+    /* fd, touched by the loop thread only */
     struct event_io *fd_io;
     struct event_channel_map *ec_map;
+    /* channels in ec_map, read by other threads */
     unsigned int fd_amount;
+    /* channels handed to the loop by other threads and not added yet */
+    int fd_pending;
     int max_fd;
 
+    /* load, busy is an ewma of the time out of poll in LOAD_SCALE */
+    unsigned int load_busy;
+    unsigned long long load_window_at;
+    unsigned long long load_busy_us;
+    /* start of the current poll, 0 when not polling */
+    unsigned long long load_poll_at;
+
+    /* ready events of the current poll, removed channels are cleared */
+    struct event_io_event fd_events[FD_EVENTS_MAX];
+    int fd_event_count;
+    int fd_event_pos;
+
     /* milliseconds */
     unsigned int interval_ms;
 
     /* thread */
     int is_thread_ready;
+    int is_thread_joined;
     pthread_t thread_fd;
+    char thread_name[16];
     int thread_abort;
-
-    pthread_mutex_t proc_mtx;
-    pthread_cond_t proc_cond;
+    /* other threads apply commands by themselves once set */
+    int thread_exited;
+    pthread_mutex_t cmd_mtx;
+    pthread_cond_t cmd_cond;
+
+    /* wakeup, eventfd on linux and self-pipe elsewhere, fds[0] is read end */
+    int wakeup_fds[2];
+    struct event_channel *wakeup_channel;
+    int wakeup_pending;
 };
 
+/* loop run by the calling thread, NULL outside loop threads */
+static pthread_key_t _loop_current_key;
+static pthread_once_t _loop_current_once = PTHREAD_ONCE_INIT;
+
+static void 
+_loop_current_init(void)
+{
+    pthread_key_create(&_loop_current_key, NULL);
+}
+
+static struct event_loop *
+_loop_current(void)
+{
+    pthread_once(&_loop_current_once, _loop_current_init);
+    return (struct event_loop *) pthread_getspecific(_loop_current_key);
+}
+
+static int 
+_is_loop_thread(struct event_loop *eloop)
+{
+    return eloop->is_thread_ready && pthread_equal(pthread_self(), eloop->thread_fd);
+}
+
 static void 
 _wakeup_thread(struct event_loop *eloop)
 {
-    pthread_mutex_lock(&eloop->proc_mtx);
-    pthread_cond_signal(&eloop->proc_cond);
-    pthread_mutex_unlock(&eloop->proc_mtx);
+    /* the loop thread polls again after its procs anyway */
+    if (eloop->wakeup_fds[1] == -1 || _is_loop_thread(eloop))
+        return;
+
+    /* one write until the loop drains it */
+    if (__atomic_exchange_n(&eloop->wakeup_pending, 1, __ATOMIC_ACQ_REL) == 0) {
+#if defined(__linux__)
+        unsigned long long one = 1;
+#else
+        char one = 1;
+#endif
+        ssize_t n = write(eloop->wakeup_fds[1], &one, sizeof(one));
+        (void) n;
+    }
+}
+
+static int 
+_wakeup_on_read(struct event_channel *channel)
+{
+    struct event_loop *eloop = (struct event_loop *) event_channel_get_userdata(channel);
+    char buf[64];
+
+    /* clear first, a later wakeup writes again */
+    __atomic_store_n(&eloop->wakeup_pending, 0, __ATOMIC_RELEASE);
+    while (read(eloop->wakeup_fds[0], buf, sizeof(buf)) > 0)
+        /**/;
+    return 0;
+}
+
+static int 
+_wakeup_open(struct event_loop *eloop)
+{
+#if defined(__linux__)
+    eloop->wakeup_fds[0] = eloop->wakeup_fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (eloop->wakeup_fds[0] == -1)
+        return -1;
+#elif !defined(WIN32) && !defined(_WIN32)
+    if (pipe(eloop->wakeup_fds) == -1)
+        return -1;
+    for (int i = 0; i < 2; i++) {
+        fcntl(eloop->wakeup_fds[i], F_SETFL, fcntl(eloop->wakeup_fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(eloop->wakeup_fds[i], F_SETFD, FD_CLOEXEC);
+    }
+#else
+    return 0;
+#endif
+
+    eloop->wakeup_channel = event_channel_create();
+    if (!eloop->wakeup_channel)
+        return -1;
+    event_channel_set_fd(eloop->wakeup_channel, eloop->wakeup_fds[0]);
+    event_channel_set_mask(eloop->wakeup_channel, FD_MASK_READ);
+    event_channel_set_userdata(eloop->wakeup_channel, eloop);
+    event_channel_set_read_proc(eloop->wakeup_channel, _wakeup_on_read);
+    return event_io_add_fd(eloop->fd_io, eloop->wakeup_channel);
+}
+
+static void 
+_wakeup_close(struct event_loop *eloop)
+{
+    if (eloop->wakeup_channel) {
+        if (eloop->fd_io)   event_io_remove_fd(eloop->fd_io, eloop->wakeup_channel);
+        event_channel_delete(&eloop->wakeup_channel);
+    }
+    if (eloop->wakeup_fds[0] != -1)
+        close(eloop->wakeup_fds[0]);
+    if (eloop->wakeup_fds[1] != -1 && eloop->wakeup_fds[1] != eloop->wakeup_fds[0])
+        close(eloop->wakeup_fds[1]);
+    eloop->wakeup_fds[0] = eloop->wakeup_fds[1] = -1;
+}
+
+/* 
+ * job nodes are recycled through a shared free stack, every thread keeps a 
+ * private cache refilled by taking the whole stack in one exchange, so no 
+ * pop races on the shared stack.
+ */
+static struct event_job *_job_free_stack;
+static pthread_key_t _job_cache_key;
+static pthread_once_t _job_cache_once = PTHREAD_ONCE_INIT;
+
+static void 
+_job_free_push(struct event_job *first, struct event_job *last)
+{
+    struct event_job *head = __atomic_load_n(&_job_free_stack, __ATOMIC_RELAXED);
+
+    do {
+        last->next = head;
+    } while (!__atomic_compare_exchange_n(&_job_free_stack, &head, first, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
 }
 
-static void _job_free(struct event_job *job)
+/* thread exit hands its cache back */
+static void 
+_job_cache_destroy(void *cache)
 {
-    if (job)  free(job);
+    struct event_job *first = (struct event_job *) cache;
+    struct event_job *last = first;
+
+    while (last->next)  last = last->next;
+    _job_free_push(first, last);
+}
+
+static void 
+_job_cache_init(void)
+{
+    pthread_key_create(&_job_cache_key, _job_cache_destroy);
+}
+
+static struct event_job *
+_job_alloc(void)
+{
+    struct event_job *job;
+
+    pthread_once(&_job_cache_once, _job_cache_init);
+
+    job = (struct event_job *) pthread_getspecific(_job_cache_key);
+    if (!job)
+        job = __atomic_exchange_n(&_job_free_stack, NULL, __ATOMIC_ACQUIRE);
+    if (!job)
+        return (struct event_job *) malloc(sizeof(*job));
+
+    pthread_setspecific(_job_cache_key, job->next);
+    return job;
+}
+
+/* push a linked chain, first becomes the new head */
+static void 
+_job_push(struct event_loop *eloop, struct event_job *first, struct event_job *last)
+{
+    struct event_job *head = __atomic_load_n(&eloop->job_head, __ATOMIC_RELAXED);
+
+    do {
+        last->next = head;
+    } while (!__atomic_compare_exchange_n(&eloop->job_head, &head, first, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    /* the first producer of a batch wakes the loop */
+    if (!head)
+        _wakeup_thread(eloop);
 }
 
 static int 
 _job_add(struct event_loop *eloop, struct event_job *job)
 {
-    struct event_job *_job = (struct event_job *) calloc(1, sizeof(*_job));
+    struct event_job *_job = _job_alloc();
 
-    if (_job) {
-        memmove(_job, job, sizeof(*_job));
+    if (!_job)
+        return -1;
 
-        pthread_mutex_lock(&eloop->job_mtx);
-        list_append(eloop->job_list, _job);
-        pthread_mutex_unlock(&eloop->job_mtx);
-    }
+    *_job = *job;
+    _job_push(eloop, _job, _job);
+    return 0;
+}
 
-    return job ? 0 : -1;
+static int 
+_job_pending(struct event_loop *eloop)
+{
+    return eloop->job_backlog != NULL 
+        || __atomic_load_n(&eloop->job_head, __ATOMIC_ACQUIRE) != NULL;
 }
 
 static int 
 _job_proc(struct event_loop *eloop, int is_remove_all)
 {
     int ret = 0;
+    struct event_job *jobs = __atomic_exchange_n(&eloop->job_head, NULL, __ATOMIC_ACQUIRE);
+    struct event_job *first = NULL;
+    struct event_job *last = jobs;
+    struct event_job *job;
+
+    if (jobs) {
+        /* stack to FIFO, queued behind the backlog */
+        while (jobs) {
+            struct event_job *next = jobs->next;
+
+            jobs->next = first;
+            first = jobs;
+            jobs = next;
+        }
 
-    pthread_mutex_lock(&eloop->job_mtx);
+        if (eloop->job_backlog)
+            eloop->job_backlog_tail->next = first;
+        else
+            eloop->job_backlog = first;
+        eloop->job_backlog_tail = last;
+    }
 
-    if (is_remove_all) {
-        list_remove_all(eloop->job_list, _job_free);
-        goto EXIT;
+    first = eloop->job_backlog;
+    if (!first)
+        return ret;
+
+    /* no lock held, producers keep pushing meanwhile */
+    for (job = first; job != NULL; job = job->next) {
+        if (!is_remove_all) {
+            if ((unsigned int) ret == eloop->job_budget)
+                break;
+            job->on_job(eloop, job->userdata1, job->userdata2, job->userdata3);
+        } else if (job->is_cmd) {
+            /* commands own memory or have a waiter */
+            job->on_job(eloop, job->userdata1, job->userdata2, job->userdata3);
+        } else if (job->on_drop) {
+            job->on_drop(eloop, job->userdata1, job->userdata2, job->userdata3);
+        }
+        last = job;
+        ret++;
     }
 
-    for (struct list_node *node = list_get_head(eloop->job_list); node != NULL; /**/) {
-        struct list_node *next = list_get_next(node);
-        struct event_job *job = (struct event_job *) list_get_data(node);
+    /* the rest runs next iteration, after fds and timers had their turn */
+    eloop->job_backlog = job;
+    if (!job)
+        eloop->job_backlog_tail = NULL;
+
+    _job_free_push(first, last);
+    return ret;
+}
+
+static unsigned long long 
+_now_ns(void)
+{
+    struct timespec now = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long) now.tv_sec * 1000 * 1000 * 1000 + now.tv_nsec;
+}
+
+static unsigned long long 
+_now_us(void)
+{
+    return _now_ns() / 1000;
+}
+
+/* first wheel tick not before now, timers never fire early */
+static unsigned long long 
+_now_tick(void)
+{
+    return (_now_us() + TIMER_TICK_US - 1) / TIMER_TICK_US;
+}
+
+static unsigned long long 
+_ns_2_ticks(unsigned long long interval_ns)
+{
+    return (interval_ns + TIMER_TICK_US * 1000 - 1) / (TIMER_TICK_US * 1000);
+}
 
-        /* notify when fire */
-        job->on_job(eloop, job->userdata1, job->userdata2, job->userdata3);
-        /* remove */
-        list_remove_node(eloop->job_list, node, _job_free);
+static void 
+_clock_update(struct event_loop *eloop)
+{
+    __atomic_store_n(&eloop->now_us, _now_us(), __ATOMIC_RELAXED);
+}
 
-        node = next;
+static void 
+_fd_forget(struct event_loop *eloop, struct event_channel *channel)
+{
+    /* not dispatch the channel any more in this poll */
+    for (int i = eloop->fd_event_pos; i < eloop->fd_event_count; i++) {
+        if (eloop->fd_events[i].channel == channel)
+            eloop->fd_events[i].channel = NULL;
     }
+}
 
-EXIT:
-    pthread_mutex_unlock(&eloop->job_mtx);
-    return ret;
+/* still registered for mask, the snapshot of the poll may be stale */
+static int 
+_fd_is_ready(struct event_io_event *event, int mask)
+{
+    return event->channel && (event->mask & mask) && (event_channel_get_io_mask(event->channel) & mask);
 }
 
 static int 
@@ -128,197 +480,692 @@ _fd_proc(struct event_loop *eloop, unsigned long long timeout)
 {
     int ret = 0;
 
-    pthread_mutex_lock(&eloop->fd_mtx);
-    ret = event_io_poll(eloop->fd_io, eloop->ec_map, timeout);
-    pthread_mutex_unlock(&eloop->fd_mtx);
+    ret = event_io_poll(eloop->fd_io, eloop->fd_events, FD_EVENTS_MAX, timeout);
+    _clock_update(eloop);
+    eloop->fd_event_count = ret > 0 ? ret : 0;
 
+    for (eloop->fd_event_pos = 0; eloop->fd_event_pos < eloop->fd_event_count; eloop->fd_event_pos++) {
+        struct event_io_event *event = &eloop->fd_events[eloop->fd_event_pos];
+
+        /* every proc may remove the channel or drop an interest reported ready */
+        if (_fd_is_ready(event, FD_MASK_READ))      event_channel_on_read(event->channel);
+        if (_fd_is_ready(event, FD_MASK_WRITE))     event_channel_on_write(event->channel);
+        if (_fd_is_ready(event, FD_MASK_ERROR))     event_channel_on_error(event->channel);
+        if (event->channel && (event->mask & FD_MASK_CLOSE))    event_channel_on_close(event->channel);
+    }
+    eloop->fd_event_count = eloop->fd_event_pos = 0;
     return ret;
 }
 
+static struct event_timer *
+_timer_at(struct event_loop *eloop, int slot)
+{
+    return &eloop->timer_pages[slot >> TIMER_PAGE_BITS][slot & (TIMER_PAGE_SIZE - 1)];
+}
+
+static int 
+_timer_expand(struct event_loop *eloop)
+{
+    int base = eloop->timer_page_count * TIMER_PAGE_SIZE;
+    struct event_timer **pages = (struct event_timer **) realloc(eloop->timer_pages
+            , (eloop->timer_page_count + 1) * sizeof(*pages));
+    struct event_timer *page;
+
+    if (!pages) return -1;
+    eloop->timer_pages = pages;
+
+    page = (struct event_timer *) calloc(TIMER_PAGE_SIZE, sizeof(*page));
+    if (!page)  return -1;
+    eloop->timer_pages[eloop->timer_page_count++] = page;
+
+    /* chain new slots in front of the free list */
+    for (int i = TIMER_PAGE_SIZE - 1; i >= 0; i--) {
+        timer_wheel_node_init(&page[i].node);
+        timer_heap_node_init(&page[i].heap_node);
+        page[i].next_free = eloop->timer_free;
+        eloop->timer_free = base + i;
+    }
+    return 0;
+}
+
 static void 
-_ts_plus(struct timespec *ts, unsigned int interval_ms)
+_timer_fd_arm(struct event_loop *eloop)
+{
+#if defined(__linux__)
+    struct timer_heap_node *top = timer_heap_top(eloop->timer_heap);
+    unsigned long long expire = top ? top->expire : 0;
+    struct itimerspec its = {{0, 0}, {0, 0}};
+
+    /* 0 disarms */
+    if (eloop->timer_fd == -1 || expire == eloop->timer_fd_armed)
+        return;
+
+    its.it_value.tv_sec = expire / (1000 * 1000 * 1000);
+    its.it_value.tv_nsec = expire % (1000 * 1000 * 1000);
+    if (timerfd_settime(eloop->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) == 0)
+        eloop->timer_fd_armed = expire;
+#endif
+}
+
+static unsigned int 
+_alias_hash(long long alias, unsigned int size)
+{
+    return (unsigned int) (((unsigned long long) alias * 0x9e3779b97f4a7c15ULL) >> 32) & (size - 1);
+}
+
+static int 
+_alias_find(struct event_loop *eloop, long long alias)
 {
-    static const long one_seconds = 1000 * 1000 * 1000;
+    unsigned int mask = eloop->alias_size - 1;
 
-    ts->tv_sec += interval_ms / 1000;
-    ts->tv_nsec += (interval_ms % 1000) * 1000 * 1000;
-    if (ts->tv_nsec >= one_seconds) {
-        ts->tv_sec += ts->tv_nsec / one_seconds;
-        ts->tv_nsec %= one_seconds;
+    if (eloop->alias_count == 0)
+        return -1;
+
+    for (unsigned int i = _alias_hash(alias, eloop->alias_size); eloop->alias_keys[i] != 0; i = (i + 1) & mask) {
+        if (eloop->alias_keys[i] == alias)
+            return (int) i;
     }
+    return -1;
 }
 
 static int 
-_timer_compare(struct timespec      *ts1, struct timespec *ts2)
+_alias_expand(struct event_loop *eloop)
 {
-    int ret = 0;
-    long long t1 = ts1->tv_sec * 1000 * 1000 * 1000 + ts1->tv_nsec;
-    long long t2 = ts2->tv_sec * 1000 * 1000 * 1000 + ts2->tv_nsec;
+    unsigned int size = eloop->alias_size ? eloop->alias_size * 2 : 64;
+    long long *keys = (long long *) calloc(size, sizeof(*keys));
+    int *slots = (int *) calloc(size, sizeof(*slots));
+
+    if (!keys || !slots) {
+        free(keys);
+        free(slots);
+        return -1;
+    }
 
-    if (t1 < t2)        ret = -1;
-    else if (t1 > t2)   ret = 1;
-    return ret;
+    for (unsigned int i = 0; i < eloop->alias_size; i++) {
+        unsigned int j;
+
+        if (eloop->alias_keys[i] == 0)
+            continue;
+        for (j = _alias_hash(eloop->alias_keys[i], size); keys[j] != 0; j = (j + 1) & (size - 1))
+            /**/;
+        keys[j] = eloop->alias_keys[i];
+        slots[j] = eloop->alias_slots[i];
+    }
+
+    free(eloop->alias_keys);
+    free(eloop->alias_slots);
+    eloop->alias_keys = keys;
+    eloop->alias_slots = slots;
+    eloop->alias_size = size;
+    return 0;
 }
 
-static long long 
-_timer_add(struct event_loop *eloop, struct event_timer *tm)
+static int 
+_alias_add(struct event_loop *eloop, long long alias, int slot)
 {
-    long long ret = 0;
-    struct event_timer *timer = (struct event_timer *) calloc(1, sizeof(*timer));
+    unsigned int i;
+
+    /* half full at most */
+    if ((eloop->alias_count + 1) * 2 > eloop->alias_size && _alias_expand(eloop) != 0)
+        return -1;
 
-    if (timer) {
-        struct list_node *node = NULL;
-        char inserted = 0;
+    for (i = _alias_hash(alias, eloop->alias_size); eloop->alias_keys[i] != 0; i = (i + 1) & (eloop->alias_size - 1))
+        /**/;
+    eloop->alias_keys[i] = alias;
+    eloop->alias_slots[i] = slot;
+    eloop->alias_count++;
+    return 0;
+}
 
-        *timer = *tm;
+static void 
+_alias_remove(struct event_loop *eloop, long long alias)
+{
+    unsigned int mask = eloop->alias_size - 1;
+    int pos = _alias_find(eloop, alias);
+    unsigned int i, j;
 
-        pthread_mutex_lock(&eloop->timer_mtx);
+    if (pos < 0)
+        return;
 
-        /* id */
-        if (tm->id < 1) {
-            if (++eloop->tid <= 0)
-                eloop->tid = 1;
-            ret = timer->id = eloop->tid;
-        } else
-            ret = tm->id;
+    /* shift later entries of the run back, so lookups never need tombstones */
+    for (i = j = (unsigned int) pos; /**/; /**/) {
+        unsigned int home;
 
-        /* increment */
-        for (node = list_get_head(eloop->timer_list); node != NULL; node = list_get_next(node)) {
-            struct event_timer *timer_item = (struct event_timer *) list_get_data(node);
-            if (_timer_compare(&timer->ts, &timer_item->ts) <= 0) {
-                list_append_before(eloop->timer_list, timer, node);
-                inserted = 1;
-                break;
-            }
-        }
+        j = (j + 1) & mask;
+        if (eloop->alias_keys[j] == 0)
+            break;
+
+        /* stays when its home lies cyclically in (i, j] */
+        home = _alias_hash(eloop->alias_keys[j], eloop->alias_size);
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+            continue;
+
+        eloop->alias_keys[i] = eloop->alias_keys[j];
+        eloop->alias_slots[i] = eloop->alias_slots[j];
+        i = j;
+    }
+    eloop->alias_keys[i] = 0;
+    eloop->alias_count--;
+}
+
+static void _timer_free(struct event_loop *eloop, struct event_timer *timer);
+
+static struct event_timer *
+_timer_find(struct event_loop *eloop, long long id)
+{
+    int slot = (int) (id & 0xffffffff);
+    struct event_timer *timer;
+
+    if (id > 0 && (id & TIMER_ALIAS_BIT)) {
+        int pos = _alias_find(eloop, id);
+
+        if (pos < 0)
+            return NULL;
+        timer = _timer_at(eloop, eloop->alias_slots[pos]);
+        return timer->alias == id ? timer : NULL;
+    }
+
+    if (id <= 0 || slot >= eloop->timer_page_count * TIMER_PAGE_SIZE)
+        return NULL;
 
-        /* tail */
-        if (inserted == 0)  list_append(eloop->timer_list, timer);
+    timer = _timer_at(eloop, slot);
+    return timer->id == id ? timer : NULL;
+}
+
+/* 
+ * latest multiple of the largest power of two within slack, timers with 
+ * overlapping slack meet at the same grid point and fire together.
+ */
+static unsigned long long 
+_slack_align(unsigned long long deadline, unsigned long long slack)
+{
+    unsigned long long grain;
+
+    if (slack == 0)
+        return deadline;
+
+    grain = 1ULL << (63 - __builtin_clzll(slack));
+    return (deadline + grain - 1) & ~(grain - 1);
+}
+
+static int 
+_timer_schedule(struct event_loop *eloop, struct event_timer *timer, unsigned long long deadline)
+{
+    unsigned long long expire = _slack_align(deadline, timer->slack);
+
+    timer->deadline = deadline;
+    if (!timer->is_hires) {
+        timer_wheel_add(eloop->timer_wheel, &timer->node, expire);
+        return 0;
+    }
+    return timer_heap_add(eloop->timer_heap, &timer->heap_node, expire);
+}
 
-        pthread_mutex_unlock(&eloop->timer_mtx);
-    } else
+static long long 
+_timer_add(struct event_loop *eloop, struct event_timer *tm)
+{
+    long long ret = -1;
+    struct event_timer *timer;
+    int slot;
+
+    if (eloop->timer_free == -1 && _timer_expand(eloop) != 0)
+        return ret;
+
+    slot = eloop->timer_free;
+    timer = _timer_at(eloop, slot);
+    if (tm->alias && _alias_add(eloop, tm->alias, slot) != 0)
+        return ret;
+    eloop->timer_free = timer->next_free;
+
+    /* generation keeps ids of reused slots unique */
+    timer->gen = (timer->gen + 1) & TIMER_GEN_MASK;
+    if (timer->gen == 0)    timer->gen = 1;
+
+    timer->id = ((long long) timer->gen << 32) | slot;
+    timer->alias = tm->alias;
+    ret = timer->alias ? timer->alias : timer->id;
+    timer->interval_ns = tm->interval_ns;
+    timer->is_hires = tm->is_hires && eloop->timer_fd != -1;
+    timer->type = tm->type;
+    timer->missed = tm->missed;
+    timer->on_timer = tm->on_timer;
+    timer->userdata = tm->userdata;
+
+    /* template keeps slack in nanoseconds */
+    timer->slack = timer->is_hires ? tm->slack : _ns_2_ticks(tm->slack);
+
+    if (_timer_schedule(eloop, timer, timer->is_hires ? _now_ns() + timer->interval_ns 
+                : _now_tick() + _ns_2_ticks(timer->interval_ns)) != 0) {
+        _timer_free(eloop, timer);
         ret = -1;
+    } else if (timer->is_hires) {
+        _timer_fd_arm(eloop);
+    }
 
     return ret;
 }
 
-static void _timer_free(struct event_timer *timer)
+static void 
+_timer_free(struct event_loop *eloop, struct event_timer *timer)
 {
-    if (timer)  free(timer);
+    int slot = (int) (timer->id & 0xffffffff);
+
+    timer_wheel_remove(eloop->timer_wheel, &timer->node);
+    if (timer_heap_node_is_added(&timer->heap_node)) {
+        timer_heap_remove(eloop->timer_heap, &timer->heap_node);
+        _timer_fd_arm(eloop);
+    }
+    if (timer->alias)
+        _alias_remove(eloop, timer->alias);
+    timer->id = timer->alias = 0;
+    timer->on_timer = NULL;
+    timer->userdata = NULL;
+    timer->next_free = eloop->timer_free;
+    eloop->timer_free = slot;
 }
 
 static int 
 _timer_remove(struct event_loop *eloop, long long id)
 {
-    int ret = -1;
-    struct list_node *node = NULL;
+    struct event_timer *timer = _timer_find(eloop, id);
 
-    pthread_mutex_lock(&eloop->timer_mtx);
+    if (!timer)
+        return -1;
 
-    for (node = list_get_head(eloop->timer_list); node != NULL; node = list_get_next(node)) {
-        struct event_timer *timer_item = (struct event_timer *) list_get_data(node);
+    _timer_free(eloop, timer);
+    return 0;
+}
 
-        if (timer_item->id == id) {
-            list_remove_node(eloop->timer_list, node, _timer_free);
-            ret = 0;
-            break;
-        }
-    }
+/* microseconds left to the head deadline, infinite without timer */
+static unsigned long long 
+_timer_min(struct event_loop *eloop)
+{
+    unsigned long long ret = EVENT_IO_TIMEOUT_INFINITE;
+    unsigned long long next = timer_wheel_next(eloop->timer_wheel);
 
-    pthread_mutex_unlock(&eloop->timer_mtx);
+    if (next != TIMER_WHEEL_NEVER) {
+        unsigned long long now = _now_us();
+        ret = next * TIMER_TICK_US > now ? next * TIMER_TICK_US - now : 0;
+    }
     return ret;
 }
 
-static unsigned int 
-_timer_min(struct event_loop *eloop)
+/* fixed rate, the next deadline of a forever timer follows the previous one */
+static unsigned long long 
+_timer_next_expire(struct event_timer *timer, 
+                   unsigned long long prev, 
+                   unsigned long long now, 
+                   unsigned long long interval)
 {
-    unsigned int ret = 0xffffffff;
+    unsigned long long expire;
 
-    pthread_mutex_lock(&eloop->timer_mtx);
+    if (interval == 0)  interval = 1;
+    expire = prev + interval;
 
-    if (list_length(eloop->timer_list) > 0) {
-        struct list_node *node = list_get_head(eloop->timer_list);
-        struct event_timer *timer_head = (struct event_timer *) list_get_data(node);
-        ret = timer_head->interval_ms;
+    if (expire < now) {
+        if (timer->missed == timer_missed_skip)
+            expire += (now - expire + interval - 1) / interval * interval;
+        else if (timer->missed == timer_missed_coalesce)
+            expire = now + interval;
     }
+    return expire;
+}
 
-    pthread_mutex_unlock(&eloop->timer_mtx);
-    return ret;
+static void 
+_timer_fire(struct timer_wheel *wheel, struct timer_wheel_node *node, void *userdata)
+{
+    struct event_loop *eloop = (struct event_loop *) userdata;
+    /* node is the first member */
+    struct event_timer *timer = (struct event_timer *) node;
+    long long id = timer->id;
+
+    /* notify when fire, with the id its owner holds */
+    timer->on_timer(eloop, timer->alias ? timer->alias : id, timer->userdata);
+
+    /* removed by the proc */
+    if (timer->id != id)
+        return;
+
+    if (timer->type == timer_type_one_shot)
+        _timer_free(eloop, timer);
+    else
+        _timer_schedule(eloop, timer, _timer_next_expire(timer, timer->deadline
+                    , eloop->now_us / TIMER_TICK_US, _ns_2_ticks(timer->interval_ns)));
 }
 
 static void 
 _timer_proc(struct event_loop *eloop, int is_remove_all)
 {
-    struct timespec now = {0};
+    if (is_remove_all) {
+        for (int slot = 0; slot < eloop->timer_page_count * TIMER_PAGE_SIZE; slot++) {
+            struct event_timer *timer = _timer_at(eloop, slot);
+            if (timer->id != 0) _timer_free(eloop, timer);
+        }
+        return;
+    }
 
-    pthread_mutex_lock(&eloop->timer_mtx);
+    timer_wheel_expire(eloop->timer_wheel, eloop->now_us / TIMER_TICK_US, _timer_fire, eloop);
+}
 
-    if (is_remove_all) {
-        list_remove_all(eloop->timer_list, _timer_free);
+static int 
+_timer_fd_on_read(struct event_channel *channel)
+{
+    struct event_loop *eloop = (struct event_loop *) event_channel_get_userdata(channel);
+    struct timer_heap_node *top;
+    unsigned long long count, now;
+    ssize_t n = read(eloop->timer_fd, &count, sizeof(count));
+
+    (void) n;
+
+    /* expired timerfd is disarmed */
+    eloop->timer_fd_armed = 0;
+    now = _now_ns();
+
+    while ((top = timer_heap_top(eloop->timer_heap)) != NULL && top->expire <= now) {
+        struct event_timer *timer = (struct event_timer *) ((char *) top - offsetof(struct event_timer, heap_node));
+        long long id = timer->id;
+
+        timer_heap_remove(eloop->timer_heap, top);
+
+        /* notify when fire, with the id its owner holds */
+        timer->on_timer(eloop, timer->alias ? timer->alias : id, timer->userdata);
+
+        /* removed by the proc */
+        if (timer->id != id)
+            continue;
+
+        if (timer->type == timer_type_one_shot)
+            _timer_free(eloop, timer);
+        else
+            _timer_schedule(eloop, timer, _timer_next_expire(timer, timer->deadline, now, timer->interval_ns));
+    }
+
+    _timer_fd_arm(eloop);
+    return 0;
+}
+
+static int 
+_timer_fd_open(struct event_loop *eloop)
+{
+    eloop->timer_fd = -1;
+#if defined(__linux__)
+    /* high resolution timers fall back to the wheel */
+    eloop->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (eloop->timer_fd == -1)
+        return 0;
+
+    eloop->timer_channel = event_channel_create();
+    if (!eloop->timer_channel)
+        return -1;
+    event_channel_set_fd(eloop->timer_channel, eloop->timer_fd);
+    event_channel_set_mask(eloop->timer_channel, FD_MASK_READ);
+    event_channel_set_userdata(eloop->timer_channel, eloop);
+    event_channel_set_read_proc(eloop->timer_channel, _timer_fd_on_read);
+    return event_io_add_fd(eloop->fd_io, eloop->timer_channel);
+#else
+    return 0;
+#endif
+}
+
+static void 
+_timer_fd_close(struct event_loop *eloop)
+{
+    if (eloop->timer_channel) {
+        if (eloop->fd_io)   event_io_remove_fd(eloop->fd_io, eloop->timer_channel);
+        event_channel_delete(&eloop->timer_channel);
+    }
+    if (eloop->timer_fd != -1)
+        close(eloop->timer_fd);
+    eloop->timer_fd = -1;
+}
+
+static int 
+_channel_add(struct event_loop *eloop, struct event_channel *channel)
+{
+    int ret = event_channel_map_add(eloop->ec_map, channel);
+
+    /* backend refused the fd, e.g. select beyond FD_SETSIZE, not kept unpolled */
+    if (ret == 0 && (ret = event_io_add_fd(eloop->fd_io, channel)) != 0)
+        event_channel_map_remove(eloop->ec_map, event_channel_get_fd(channel));
+    __atomic_store_n(&eloop->fd_amount, (unsigned int) event_channel_map_get_length(eloop->ec_map), __ATOMIC_RELAXED);
+    return ret;
+}
+
+static int 
+_channel_update(struct event_loop *eloop, struct event_channel *channel)
+{
+    int origin_mask = event_channel_get_mask(channel);
+
+    event_channel_set_mask(channel, FD_MASK_READ | FD_MASK_WRITE | FD_MASK_ERROR);
+    event_io_remove_fd(eloop->fd_io, channel);
+
+    event_channel_set_mask(channel, origin_mask);
+    return event_io_add_fd(eloop->fd_io, channel);
+}
+
+static int 
+_channel_remove(struct event_loop *eloop, struct event_channel *channel)
+{
+    /* remove mark with mask */
+    event_io_remove_fd(eloop->fd_io, channel);
+
+    /* delete when NONE */
+    _fd_forget(eloop, channel);
+    event_channel_map_remove(eloop->ec_map, event_channel_get_fd(channel));
+    __atomic_store_n(&eloop->fd_amount, (unsigned int) event_channel_map_get_length(eloop->ec_map), __ATOMIC_RELAXED);
+    return 0;
+}
+
+static int 
+_fd_remove(struct event_loop *eloop, int fd, int mask, int *is_delete)
+{
+    struct event_channel *channel = event_channel_map_find(eloop->ec_map, fd);
+    int origin_mask;
+
+    *is_delete = 0;
+    if (!channel)
+        return -1;
+
+    /* origin */
+    origin_mask = event_channel_get_mask(channel);
+
+    /* update to remove mask */
+    event_channel_set_mask(channel, mask);
+    /* remove mark with mask */
+    event_io_remove_fd(eloop->fd_io, channel);
+    /* reset to origin */
+    event_channel_set_mask(channel, origin_mask);
+    event_channel_remove_mask(channel, mask);
+
+    /* remove when NONE */
+    if (event_channel_get_mask(channel) == FD_MASK_NONE) {
+        _fd_forget(eloop, channel);
+        event_channel_map_remove(eloop->ec_map, fd);
+        __atomic_store_n(&eloop->fd_amount, (unsigned int) event_channel_map_get_length(eloop->ec_map), __ATOMIC_RELAXED);
+        *is_delete = 1;
+    }
+    return 0;
+}
+
+static long long 
+_cmd_apply(struct event_loop *eloop, struct event_cmd *cmd)
+{
+    switch (cmd->type) {
+    case event_cmd_add_channel:     return _channel_add(eloop, cmd->channel);
+    case event_cmd_update_channel:  return _channel_update(eloop, cmd->channel);
+    case event_cmd_remove_channel:  return _channel_remove(eloop, cmd->channel);
+    case event_cmd_remove_fd:       return _fd_remove(eloop, cmd->fd, cmd->mask, &cmd->is_delete);
+    case event_cmd_add_timer:       return _timer_add(eloop, &cmd->timer);
+    case event_cmd_remove_timer:    return _timer_remove(eloop, cmd->id);
+    }
+    return -1;
+}
+
+static int 
+_cmd_on_job(struct event_loop *eloop, void *userdata1, void *userdata2, void *userdata3)
+{
+    struct event_cmd *cmd = (struct event_cmd *) userdata1;
+    long long ret = _cmd_apply(eloop, cmd);
+
+    if (!cmd->is_sync) {
+        /* the caller got 0 already, the close proc lets it release the channel */
+        if (cmd->type == event_cmd_add_channel && ret != 0)
+            event_channel_on_close(cmd->channel);
+        free(cmd);
+        return 0;
+    }
+
+    pthread_mutex_lock(&eloop->cmd_mtx);
+    cmd->ret = ret;
+    cmd->done = 1;
+    pthread_cond_broadcast(&eloop->cmd_cond);
+    pthread_mutex_unlock(&eloop->cmd_mtx);
+    return 0;
+}
+
+/* 
+ * loop state belongs to the loop thread, it applies the operation directly
+ * without any lock, other threads queue it as a job. async commands return 0
+ * once queued, sync ones wait for the result.
+ *
+ * a loop thread never waits for another loop, two loops waiting for each 
+ * other would deadlock, the sync command fails with EDEADLK instead.
+ */
+static long long 
+_cmd_run(struct event_loop *eloop, struct event_cmd *cmd)
+{
+    long long ret = -1;
+    struct event_job job = {0};
+
+    if (_is_loop_thread(eloop))
+        return _cmd_apply(eloop, cmd);
+
+    pthread_mutex_lock(&eloop->cmd_mtx);
+
+    /* nobody else touches the loop any more */
+    if (eloop->thread_exited || !eloop->is_thread_ready) {
+        ret = _cmd_apply(eloop, cmd);
         goto EXIT;
     }
 
-    for (struct list_node *node = list_get_head(eloop->timer_list); node != NULL; /**/) {
-        struct list_node *next = list_get_next(node);
-        struct event_timer *timer = (struct event_timer *) list_get_data(node);
-
-        clock_gettime(CLOCK_MONOTONIC, &now);
-        if (_timer_compare(&now, &timer->ts) >= 0) {
-            /* notify when fire */
-            timer->on_timer(eloop, timer->id, timer->userdata);
-            /* remove */
-            list_remove_node(eloop->timer_list, node, NULL);
-            /* next */
-            node = next;
-
-            if (timer->type == timer_type_one_shot) {
-                free(timer);
-                continue;
-            } else {
-                timer->ts = now;
-                _ts_plus(&timer->ts, timer->interval_ms);
-                _timer_add(eloop, timer);
-                free(timer);
-            }
-        } else
-            break;
+    job.on_job = _cmd_on_job;
+    job.is_cmd = 1;
+    if (cmd->is_sync) {
+        struct event_loop *current = _loop_current();
+
+        if (current && current != eloop) {
+            errno = EDEADLK;
+            goto EXIT;
+        }
+        job.userdata1 = cmd;
+        if (_job_add(eloop, &job) != 0)
+            goto EXIT;
+        while (!cmd->done)
+            pthread_cond_wait(&eloop->cmd_cond, &eloop->cmd_mtx);
+        ret = cmd->ret;
+    } else {
+        job.userdata1 = malloc(sizeof(*cmd));
+        if (!job.userdata1)
+            goto EXIT;
+        memcpy(job.userdata1, cmd, sizeof(*cmd));
+        if (_job_add(eloop, &job) != 0) {
+            free(job.userdata1);
+            goto EXIT;
+        }
+        ret = 0;
     }
 
 EXIT:
-    pthread_mutex_unlock(&eloop->timer_mtx);
+    pthread_mutex_unlock(&eloop->cmd_mtx);
+    return ret;
+}
+
+/* account the time since poll returned, at the end of an iteration */
+static void 
+_load_update(struct event_loop *eloop, unsigned long long busy_from)
+{
+    unsigned long long now = _now_us();
+    unsigned long long span;
+
+    eloop->load_busy_us += now > busy_from ? now - busy_from : 0;
+    span = now - eloop->load_window_at;
+    if (span >= LOAD_WINDOW_US) {
+        unsigned int busy = (unsigned int) (eloop->load_busy_us * LOAD_SCALE / span);
+        unsigned int ewma = __atomic_load_n(&eloop->load_busy, __ATOMIC_RELAXED);
+
+        if (busy > LOAD_SCALE)  busy = LOAD_SCALE;
+        __atomic_store_n(&eloop->load_busy, (ewma * 3 + busy) / 4, __ATOMIC_RELAXED);
+        eloop->load_window_at = now;
+        eloop->load_busy_us = 0;
+    }
+    __atomic_store_n(&eloop->load_poll_at, now, __ATOMIC_RELAXED);
 }
 
 static void *
 _thread_func(void *userdata)
 {
     struct event_loop *eloop = (struct event_loop *) userdata;
-    unsigned long long interval, timer_min_interval, fd_min_interval = 10;
+    unsigned long long interval;
 
+    pthread_once(&_loop_current_once, _loop_current_init);
+    pthread_setspecific(_loop_current_key, eloop);
+
+#if defined(__linux__)
+    if (eloop->thread_name[0])
+        pthread_setname_np(pthread_self(), eloop->thread_name);
+#endif
+
+    eloop->load_window_at = _now_us();
+    __atomic_store_n(&eloop->load_poll_at, eloop->load_window_at, __ATOMIC_RELAXED);
     while (!eloop->thread_abort) {
-        timer_min_interval = _timer_min(eloop);
-        interval = timer_min_interval <= fd_min_interval ? timer_min_interval : fd_min_interval;
+        interval = _timer_min(eloop);
+#if defined(FD_TICK_MS)
+        if (interval > FD_TICK_MS * 1000)
+            interval = FD_TICK_MS * 1000;
+#endif
+        /* jobs added by the loop itself do not wakeup */
+        if (_job_pending(eloop))
+            interval = 0;
 
         _fd_proc(eloop, interval);
+        __atomic_store_n(&eloop->load_poll_at, 0, __ATOMIC_RELAXED);
         _timer_proc(eloop, 0);
         _job_proc(eloop, 0);
+        _load_update(eloop, eloop->now_us);
     }
 
-    _timer_proc(eloop, 1);
+    /* 
+     * queued commands still apply, later ones are applied by their callers
+     * under cmd_mtx, which is recursive for the sync commands drained here.
+     */
+    pthread_mutex_lock(&eloop->cmd_mtx);
+    eloop->thread_exited = 1;
     _job_proc(eloop, 1);
+    _timer_proc(eloop, 1);
+    pthread_mutex_unlock(&eloop->cmd_mtx);
     return (void *) 0;
 }
 
 struct event_loop *
 event_loop_create(void)
+{
+    return event_loop_create_with_options(NULL);
+}
+
+struct event_loop *
+event_loop_create_with_options(const struct event_loop_options *options)
 {
     pthread_mutexattr_t mtx_attr;
     pthread_condattr_t cond_attr;
+    pthread_attr_t thread_attr;
     unsigned int max_fd;
     int ret;
     struct event_loop *eloop = (struct event_loop *) calloc(1, sizeof(*eloop));
 
     if (!eloop)
         goto FAIL;
+    eloop->wakeup_fds[0] = eloop->wakeup_fds[1] = -1;
+    eloop->timer_fd = -1;
 
     /* mtx_attr */
     if (pthread_mutexattr_init(&mtx_attr)) {
@@ -341,35 +1188,66 @@ event_loop_create(void)
     /* pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC); */
 
     /* timer */
-    if (pthread_mutex_init(&eloop->timer_mtx, &mtx_attr))
+    eloop->timer_free = -1;
+    _clock_update(eloop);
+    eloop->timer_wheel = timer_wheel_create(eloop->now_us / TIMER_TICK_US);
+    if (!eloop->timer_wheel)
         goto FAIL;
-    eloop->timer_list = list_create();
-
-    /* job */
-    if (pthread_mutex_init(&eloop->job_mtx, &mtx_attr))
+    eloop->timer_heap = timer_heap_create();
+    if (!eloop->timer_heap)
         goto FAIL;
-    eloop->job_list = list_create();
+
 
     /* fd */
-    if (pthread_mutex_init(&eloop->fd_mtx, &mtx_attr))
-        goto FAIL;
     eloop->fd_amount = 0;
-    eloop->fd_io = event_io_create();
+    eloop->fd_io = event_io_create(options ? options->backend : NULL);
     if (!eloop->fd_io)
         goto FAIL;
     eloop->ec_map = event_channel_map_create();
     if (!eloop->ec_map)
         goto FAIL;    
 
-    /* thread */
-    if (pthread_mutex_init(&eloop->proc_mtx, &mtx_attr))
-        goto FAIL;    
-    if (pthread_cond_init(&eloop->proc_cond, &cond_attr))
+    /* wakeup */
+    if (_wakeup_open(eloop) != 0)
+        goto FAIL;
+    if (_timer_fd_open(eloop) != 0)
         goto FAIL;
+
+    /* job */
+    eloop->job_budget = options && options->job_budget ? options->job_budget : JOB_BUDGET_DEFAULT;
+
+    /* thread */
     eloop->interval_ms = 10;
     eloop->thread_abort = 0;
+    if (pthread_mutex_init(&eloop->cmd_mtx, &mtx_attr))
+        goto FAIL;
+    if (pthread_cond_init(&eloop->cmd_cond, &cond_attr))
+        goto FAIL;
+
+    if (options && options->name)
+        snprintf(eloop->thread_name, sizeof(eloop->thread_name), "%s", options->name);
 
-    ret = pthread_create(&eloop->thread_fd, NULL, _thread_func, (void *) eloop);
+    if (pthread_attr_init(&thread_attr))
+        goto FAIL;
+#if defined(__linux__)
+    /* pinned from the start, so the loop state is first touched on that cpu */
+    if (options && options->is_pinned) {
+        cpu_set_t cpus;
+
+        if (options->cpu >= CPU_SETSIZE) {
+            pthread_attr_destroy(&thread_attr);
+            goto FAIL;
+        }
+        CPU_ZERO(&cpus);
+        CPU_SET(options->cpu, &cpus);
+        if (pthread_attr_setaffinity_np(&thread_attr, sizeof(cpus), &cpus)) {
+            pthread_attr_destroy(&thread_attr);
+            goto FAIL;
+        }
+    }
+#endif
+    ret = pthread_create(&eloop->thread_fd, &thread_attr, _thread_func, (void *) eloop);
+    pthread_attr_destroy(&thread_attr);
     if (ret == 0)
         eloop->is_thread_ready = 1;
     else
@@ -391,60 +1269,143 @@ event_loop_delete(struct event_loop **eloop)
         struct event_loop *ep = *eloop;
 
         /* thread */
-        if (ep->is_thread_ready) {
-            ep->thread_abort = 1;
-            pthread_join(ep->thread_fd, NULL);
-        }
-        pthread_cond_destroy(&ep->proc_cond);
-        pthread_mutex_destroy(&ep->proc_mtx);
+        event_loop_stop(ep);
 
         /* timer */
-        list_delete(&ep->timer_list, _timer_free);
-        pthread_mutex_destroy(&ep->timer_mtx);
+        for (int i = 0; i < ep->timer_page_count; i++)
+            free(ep->timer_pages[i]);
+        free(ep->timer_pages);
+        timer_wheel_delete(&ep->timer_wheel);
+        timer_heap_delete(&ep->timer_heap);
+        free(ep->alias_keys);
+        free(ep->alias_slots);
 
         /* job */
-        list_delete(&ep->job_list, _job_free);
-        pthread_mutex_destroy(&ep->job_mtx);
+        _job_proc(ep, 1);
 
         /* fd */
+        _wakeup_close(ep);
+        _timer_fd_close(ep);
         event_io_delete(&ep->fd_io);
         event_channel_map_delete(&ep->ec_map);
-        pthread_mutex_destroy(&ep->fd_mtx);
+        pthread_mutex_destroy(&ep->cmd_mtx);
+        pthread_cond_destroy(&ep->cmd_cond);
 
         free(ep);
         *eloop = NULL;
     }
 }
 
+void 
+event_loop_stop(struct event_loop *eloop)
+{
+    if (eloop->is_thread_ready && !eloop->is_thread_joined) {
+        eloop->thread_abort = 1;
+        _wakeup_thread(eloop);
+        pthread_join(eloop->thread_fd, NULL);
+        eloop->is_thread_joined = 1;
+    }
+}
+
+const char *
+event_loop_get_backend(struct event_loop *eloop)
+{
+    return event_io_get_name(eloop->fd_io);
+}
+
+int 
+event_loop_get_io_features(struct event_loop *eloop)
+{
+    return event_io_get_features(eloop->fd_io);
+}
+
+unsigned long long 
+event_loop_now(struct event_loop *eloop)
+{
+    /* the cached one may be as old as a whole poll */
+    if (!_is_loop_thread(eloop))
+        return _now_us() / 1000;
+    return __atomic_load_n(&eloop->now_us, __ATOMIC_RELAXED) / 1000;
+}
+
+void 
+event_loop_get_load(struct event_loop *eloop, struct event_loop_load *load)
+{
+    unsigned long long poll_at = __atomic_load_n(&eloop->load_poll_at, __ATOMIC_RELAXED);
+
+    int pending = __atomic_load_n(&eloop->fd_pending, __ATOMIC_RELAXED);
+
+    load->channels = __atomic_load_n(&eloop->fd_amount, __ATOMIC_RELAXED);
+    if (pending > 0)    load->channels += (unsigned int) pending;
+    load->busy = __atomic_load_n(&eloop->load_busy, __ATOMIC_RELAXED);
+
+    /* blocked in poll for a whole window, the average is stale */
+    if (poll_at != 0 && _now_us() > poll_at + LOAD_WINDOW_US)
+        load->busy = 0;
+}
+
+void 
+event_loop_add_pending(struct event_loop *eloop, int count)
+{
+    __atomic_add_fetch(&eloop->fd_pending, count, __ATOMIC_RELAXED);
+}
+
 long long 
 event_loop_add_timer(struct event_loop *eloop, 
                            unsigned int interval_ms,
                            enum timer_type type,
                            event_loop_timer_proc on_timer,
                            void *userdata)
+{
+    struct event_loop_timer_options options = {0};
+
+    options.interval_ms = interval_ms;
+    options.type = type;
+    options.missed = timer_missed_skip;
+    return event_loop_add_timer_with_options(eloop, &options, on_timer, userdata);
+}
+
+long long 
+event_loop_add_timer_with_options(struct event_loop *eloop, 
+                           const struct event_loop_timer_options *options,
+                           event_loop_timer_proc on_timer,
+                           void *userdata)
 {
     long long id = 0;
+    struct event_cmd cmd = {0};
     struct event_timer timer = {0};
 
-    if (!on_timer)  return -1;
+    if (!on_timer || !options)  return -1;
 
-    timer.id = -1;
-    timer.interval_ms = interval_ms;
-    timer.type = type;
+    timer.interval_ns = options->interval_ns ? options->interval_ns 
+        : (unsigned long long) options->interval_ms * 1000 * 1000;
+    timer.is_hires = options->interval_ns != 0;
+    timer.slack = (unsigned long long) options->slack_ms * 1000 * 1000;
+    timer.type = options->type;
+    timer.missed = options->missed;
     timer.on_timer = on_timer;
     timer.userdata = userdata;    
 
-    clock_gettime(CLOCK_MONOTONIC, &timer.ts);
-    _ts_plus(&timer.ts, timer.interval_ms);
-    if ((id = _timer_add(eloop, &timer)) > 0)
-        _wakeup_thread(eloop);
-    return id;
+    /* the id is known before the loop adds the timer */
+    if (!_is_loop_thread(eloop))
+        timer.alias = TIMER_ALIAS_BIT | (__atomic_add_fetch(&eloop->alias_next, 1, __ATOMIC_RELAXED) & (TIMER_ALIAS_BIT - 1));
+
+    cmd.type = event_cmd_add_timer;
+    cmd.timer = timer;
+    id = _cmd_run(eloop, &cmd);
+    if (id < 0)
+        return -1;
+    return timer.alias ? timer.alias : id;
 }
 
 int 
 event_loop_remove_timer(struct event_loop *eloop, long long id)
 {
-    return _timer_remove(eloop, id);
+    struct event_cmd cmd = {0};
+
+    cmd.type = event_cmd_remove_timer;
+    cmd.id = id;
+    return (int) _cmd_run(eloop, &cmd);
 }
 
 int 
@@ -467,83 +1428,87 @@ event_loop_add_job(struct event_loop *eloop,
 }
 
 int 
-event_loop_add_channel(struct event_loop *eloop, struct event_channel *channel)
+event_loop_add_jobs(struct event_loop *eloop, 
+                    const struct event_loop_job *jobs, 
+                    size_t count)
 {
-    int ret = 0;
+    struct event_job *first = NULL;
+    struct event_job *last = NULL;
 
-    pthread_mutex_lock(&eloop->fd_mtx);
+    if (!jobs)  return -1;
+    for (size_t i = 0; i < count; i++) {
+        if (!jobs[i].on_job)  return -1;
+    }
+    if (count == 0)
+        return 0;
 
-    ret = event_channel_map_add(eloop->ec_map, channel);
-    if (ret == 0)   event_io_add_fd(eloop->fd_io, channel);
+    /* linked in reverse, the loop reverses the stack back to FIFO */
+    for (size_t i = 0; i < count; i++) {
+        struct event_job *job = _job_alloc();
 
-    pthread_mutex_unlock(&eloop->fd_mtx);
-    return ret;
+        if (!job) {
+            if (first)  _job_free_push(first, last);
+            return -1;
+        }
+        job->next = first;
+        job->on_job = jobs[i].on_job;
+        job->userdata1 = jobs[i].userdata1;
+        job->userdata2 = jobs[i].userdata2;
+        job->userdata3 = jobs[i].userdata3;
+        job->on_drop = jobs[i].on_drop;
+        job->is_cmd = 0;
+        first = job;
+        if (!last)  last = job;
+    }
+
+    _job_push(eloop, first, last);
+    return 0;
 }
 
 int 
-event_loop_remove_fd(struct event_loop *eloop, int fd, int mask, int *is_delete)
+event_loop_add_channel(struct event_loop *eloop, struct event_channel *channel)
 {
-    struct event_channel *channel = NULL;
+    struct event_cmd cmd = {0};
 
-    *is_delete = 0;
+    cmd.type = event_cmd_add_channel;
+    cmd.channel = channel;
+    return (int) _cmd_run(eloop, &cmd);
+}
 
-    pthread_mutex_lock(&eloop->fd_mtx);
-
-    channel = event_channel_map_find(eloop->ec_map, fd);
-    if (channel) {
-        /* origin */
-        int origin_mask = event_channel_get_mask(channel);
-
-        /* update to remove mask */
-        event_channel_set_mask(channel, mask);
-        /* remove mark with mask */
-        event_io_remove_fd(eloop->fd_io, channel);
-        /* reset to origin */
-        event_channel_set_mask(channel, origin_mask);
-        event_channel_remove_mask(channel, mask);
-
-        /* remove when NONE */
-        if (event_channel_get_mask(channel) == FD_MASK_NONE) {
-            event_channel_map_remove(eloop->ec_map, fd);
-            *is_delete = 1;
-        }
-    }
+int 
+event_loop_remove_fd(struct event_loop *eloop, int fd, int mask, int *is_delete)
+{
+    struct event_cmd cmd = {0};
+    int ret;
 
-    pthread_mutex_unlock(&eloop->fd_mtx);
-    return channel ? 0 : -1;
+    /* the caller may free the channel right after */
+    cmd.type = event_cmd_remove_fd;
+    cmd.fd = fd;
+    cmd.mask = mask;
+    cmd.is_sync = 1;
+    ret = (int) _cmd_run(eloop, &cmd);
+    *is_delete = cmd.is_delete;
+    return ret;
 }
 
 int 
 event_loop_remove_channel(struct event_loop *eloop, struct event_channel *channel)
 {
-    int fd = event_channel_get_fd(channel);
-
-    pthread_mutex_lock(&eloop->fd_mtx);
-
-    /* remove mark with mask */
-    event_io_remove_fd(eloop->fd_io, channel);
+    struct event_cmd cmd = {0};
 
-    /* delete when NONE */
-    event_channel_map_remove(eloop->ec_map, fd);
-
-    pthread_mutex_unlock(&eloop->fd_mtx);
-    return 0;
+    /* the caller may free the channel right after */
+    cmd.type = event_cmd_remove_channel;
+    cmd.channel = channel;
+    cmd.is_sync = 1;
+    return (int) _cmd_run(eloop, &cmd);
 }
 
 int 
 event_loop_update_channel(struct event_loop *eloop, struct event_channel *channel)
 {
-    int ret = 0;
-    int origin_mask = event_channel_get_mask(channel);
-
-    pthread_mutex_lock(&eloop->fd_mtx);
+    struct event_cmd cmd = {0};
 
-    event_channel_set_mask(channel, FD_MASK_READ | FD_MASK_WRITE | FD_MASK_ERROR);
-    event_io_remove_fd(eloop->fd_io, channel);
-
-    event_channel_set_mask(channel, origin_mask);
-    ret = event_io_add_fd(eloop->fd_io, channel);
-
-    pthread_mutex_unlock(&eloop->fd_mtx);
-    return ret;
+    cmd.type = event_cmd_update_channel;
+    cmd.channel = channel;
+    return (int) _cmd_run(eloop, &cmd);
 }
@@ -11,6 +11,16 @@ enum timer_type {
     timer_type_forever,    
 };
 
+/* what a forever timer does with the ticks it was too late for */
+enum timer_missed {
+    /* drop them and stay on the interval grid */
+    timer_missed_skip,
+    /* fire back to back until caught up */
+    timer_missed_burst,
+    /* fire once and restart the interval from now */
+    timer_missed_coalesce,
+};
+
 typedef int (*event_loop_fd_proc)(struct event_loop *eloop, 
                                int fd, 
                                enum fd_mask mask,
@@ -23,9 +33,82 @@ typedef int (*event_loop_job_proc)(struct event_loop *eloop,
                                 void *userdata2,
                                 void *userdata3);
 
+struct event_loop_options {
+    /* event_io backend name, NULL uses ELOOP_BACKEND or the default one */
+    const char *backend;
+    /* jobs run per iteration before fds and timers get a turn, 0 uses 1024 */
+    unsigned int job_budget;
+    /* run the thread on cpu only, linux, create fails when it is not allowed */
+    int is_pinned;
+    unsigned int cpu;
+    /* thread name for top and perf, cut to 15 chars, linux */
+    const char *name;
+};
+
+struct event_loop_load {
+    /* channels added or pending, about the live connections */
+    unsigned int channels;
+    /* recent share of time spent out of poll, 0 to 1024 */
+    unsigned int busy;
+};
+
+struct event_loop_job {
+    event_loop_job_proc on_job;
+    void *userdata1;
+    void *userdata2;
+    void *userdata3;
+    /* may be NULL, runs instead of on_job when the loop is deleted first */
+    event_loop_job_proc on_drop;
+};
+
+struct event_loop_timer_options {
+    unsigned int interval_ms;
+    enum timer_type type;
+    /* forever timers only, timer_missed_skip by default */
+    enum timer_missed missed;
+    /* 
+     * not 0 uses it instead of interval_ms and arms the loop's timerfd at
+     * nanosecond deadlines, falls back to the wheel without timerfd.
+     */
+    unsigned long long interval_ns;
+    /* may fire up to slack_ms late, so nearby timers share one wakeup */
+    unsigned int slack_ms;
+};
+
 struct event_loop *event_loop_create(void);
+struct event_loop *event_loop_create_with_options(const struct event_loop_options *options);
 void event_loop_delete(struct event_loop **eloop);
+/* 
+ * join the thread and drop queued jobs, the loop stays valid for other threads
+ * until delete, calls then apply at once. not on the loop thread.
+ */
+void event_loop_stop(struct event_loop *eloop);
+
+const char *event_loop_get_backend(struct event_loop *eloop);
+
+/* enum event_io_feature of the backend */
+int event_loop_get_io_features(struct event_loop *eloop);
 
+/* monotonic milliseconds sampled once per loop iteration, other threads get a fresh one */
+unsigned long long event_loop_now(struct event_loop *eloop);
+
+/* any thread, lock-free */
+void event_loop_get_load(struct event_loop *eloop, struct event_loop_load *load);
+/* 
+ * count channels handed to the loop before it adds them, so picks made in 
+ * a burst see each other, any thread, take them back once added.
+ */
+void event_loop_add_pending(struct event_loop *eloop, int count);
+
+/* 
+ * channel and timer calls on the loop thread apply at once without locks,
+ * other threads queue them to the loop. queued add, update and timer calls
+ * return 0 or a timer id before they apply, removing a channel waits.
+ * a channel the backend refuses is not added, a queued add that fails later
+ * runs the close proc of the channel on the loop thread.
+ * removing from the thread of another loop fails with EDEADLK, remove on
+ * the channel's own loop, e.g. from a job added to it.
+ */
 int event_loop_add_channel(struct event_loop *eloop, struct event_channel *channel);
 int event_loop_remove_fd(struct event_loop *eloop, int fd, int mask, int *is_delete);
 int event_loop_remove_channel(struct event_loop *eloop, struct event_channel *channel);
@@ -36,6 +119,10 @@ long long event_loop_add_timer(struct event_loop *eloop,
                                     enum timer_type type,
                                     event_loop_timer_proc on_timer,
                                     void *userdata);
+long long event_loop_add_timer_with_options(struct event_loop *eloop,
+                                    const struct event_loop_timer_options *options,
+                                    event_loop_timer_proc on_timer,
+                                    void *userdata);
 int event_loop_remove_timer(struct event_loop *eloop, 
                             long long id);
 
@@ -44,5 +131,9 @@ int event_loop_add_job(struct event_loop *eloop,
                        void *userdata1,
                        void *userdata2,
                        void *userdata3);
+/* all or none are queued, with one push and at most one wakeup */
+int event_loop_add_jobs(struct event_loop *eloop, 
+                        const struct event_loop_job *jobs, 
+                        size_t count);
 
 #endif
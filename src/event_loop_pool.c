@@ -6,28 +6,275 @@
  * This file is part of Eloop.
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+/* sched_getaffinity */
+#define _GNU_SOURCE
+#endif
+
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 
 #include <pthread.h>
+#if defined(__linux__)
+#include <sched.h>
+#endif
 
 #include "event_loop_pool.h"
+#include "net/net.h"
 
 #define MAX_LOOP    1024
 
+#define CACHE_LINE      64
+/* messages per ring, power of 2 */
+#define RING_SIZE       1024
+#define RING_MASK       (RING_SIZE - 1)
+
+/* connections accepted per readable event, the rest waits for the next poll */
+#define ACCEPT_BATCH    64
+
+struct pool_msg {
+    int type;
+    void *data;
+};
+
+/*
+ * single producer single consumer ring from one loop to another, each side 
+ * owns a cache line. the producer keeps a stale copy of head and reads the
+ * shared one only when the ring looks full, the consumer reads tail once per
+ * doorbell, a cached tail could miss messages sent before the doorbell cleared.
+ */
+struct pool_ring {
+    /* consumer */
+    unsigned int head __attribute__((aligned(CACHE_LINE)));
+
+    /* producer */
+    unsigned int tail __attribute__((aligned(CACHE_LINE)));
+    unsigned int head_cache;
+
+    struct pool_msg msgs[RING_SIZE] __attribute__((aligned(CACHE_LINE)));
+};
+
+/* set by the first sender after the loop drained, cleared by the drain */
+struct pool_doorbell {
+    int rung __attribute__((aligned(CACHE_LINE)));
+};
+
+/* listen fd served by one loop, accepted fds go to the others as jobs */
+struct pool_listener {
+    struct pool_listener *next;
+    /* one for the pool list, one per queued accepted fd */
+    int refs;
+    struct event_loop_pool *e_pool;
+    struct event_loop *e_loop;
+    /* accepted fds stay on e_loop, SO_REUSEPORT spreads them */
+    int is_local;
+    struct event_channel *channel;
+    event_loop_pool_accept_proc on_accept;
+    void *userdata;
+};
+
 struct event_loop_pool {
     unsigned int number;
     struct event_loop *e_loops[MAX_LOOP];
+    enum event_loop_pool_policy policy;
+    /* lock-free, only ever incremented */
     unsigned int pos;
     
     pthread_mutex_t mtx;
+
+    /* rings[from * number + to], allocated by the first send of from */
+    struct pool_ring **rings;
+    struct pool_doorbell *doorbells;
+    event_loop_pool_msg_proc on_msg;
+    void *msg_userdata;
+
+    /* under mtx */
+    struct pool_listener *listeners;
 };
 
+static int _pool_drain(struct event_loop *e_loop, void *userdata1, void *userdata2, void *userdata3)
+{
+    struct event_loop_pool *e_pool = (struct event_loop_pool *) userdata1;
+    unsigned int to = (unsigned int) (size_t) userdata2;
+
+    /* before reading tails, a later send sees 0 and rings again */
+    __atomic_exchange_n(&e_pool->doorbells[to].rung, 0, __ATOMIC_SEQ_CST);
+
+    for (unsigned int from = 0; from < e_pool->number; from++) {
+        struct pool_ring *ring = __atomic_load_n(&e_pool->rings[from * e_pool->number + to], __ATOMIC_ACQUIRE);
+        unsigned int head, tail;
+
+        if (!ring)
+            continue;
+
+        /* bounded by this snapshot, newer messages come with their own doorbell */
+        head = ring->head;
+        tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        for (/**/; head != tail; head++) {
+            struct pool_msg *msg = &ring->msgs[head & RING_MASK];
+
+            if (e_pool->on_msg)
+                e_pool->on_msg(e_pool, e_loop, from, msg->type, msg->data, e_pool->msg_userdata);
+        }
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    }
+
+    return 0;
+}
+
+static struct pool_ring *_pool_ring(struct event_loop_pool *e_pool, unsigned int from, unsigned int to)
+{
+    struct pool_ring **slot = &e_pool->rings[from * e_pool->number + to];
+    void *ring = *slot;
+
+    /* only the sender of from writes the slot */
+    if (!ring) {
+        if (posix_memalign(&ring, CACHE_LINE, sizeof(struct pool_ring)))
+            return NULL;
+        memset(ring, 0, sizeof(struct pool_ring));
+        __atomic_store_n(slot, (struct pool_ring *) ring, __ATOMIC_RELEASE);
+    }
+    return (struct pool_ring *) ring;
+}
+
+static void _pool_listener_release(struct pool_listener *listener)
+{
+    if (__atomic_sub_fetch(&listener->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        event_channel_delete(&listener->channel);
+        free(listener);
+    }
+}
+
+static int _pool_on_accepted(struct event_loop *e_loop, void *userdata1, void *userdata2, void *userdata3)
+{
+    struct pool_listener *listener = (struct pool_listener *) userdata1;
+    int fd = (int) (long) userdata2;
+
+    /* on the thread of the target loop, no lock to take */
+    if (listener->on_accept(listener->e_pool, e_loop, fd, listener->userdata) != 0)
+        net_fd_close(&fd);
+    event_loop_add_pending(e_loop, -1);
+    _pool_listener_release(listener);
+    return 0;
+}
+
+/* the target loop was deleted before the fd arrived */
+static int _pool_on_accept_dropped(struct event_loop *e_loop, void *userdata1, void *userdata2, void *userdata3)
+{
+    struct pool_listener *listener = (struct pool_listener *) userdata1;
+    int fd = (int) (long) userdata2;
+
+    net_fd_close(&fd);
+    event_loop_add_pending(e_loop, -1);
+    _pool_listener_release(listener);
+    return 0;
+}
+
+static int _pool_on_accept(struct event_channel *channel)
+{
+    struct pool_listener *listener = (struct pool_listener *) event_channel_get_userdata(channel);
+    int fds[ACCEPT_BATCH];
+    struct event_loop *targets[ACCEPT_BATCH];
+    struct event_loop_job jobs[ACCEPT_BATCH];
+    int error = 0;
+    int count = net_tcp_accept_batch(event_channel_get_fd(channel), fds, NULL, ACCEPT_BATCH, &error);
+
+    if (listener->is_local) {
+        for (int i = 0; i < count; i++) {
+            if (listener->on_accept(listener->e_pool, listener->e_loop, fds[i], listener->userdata) != 0)
+                net_fd_close(&fds[i]);
+        }
+        return 0;
+    }
+
+    /* pending from the pick on, so the rest of the batch does not herd to one loop */
+    for (int i = 0; i < count; i++) {
+        targets[i] = event_loop_pool_next(listener->e_pool);
+        event_loop_add_pending(targets[i], 1);
+    }
+
+    /* one lock-free push and at most one wakeup per target loop */
+    for (int i = 0; i < count; i++) {
+        size_t n = 0;
+
+        if (!targets[i])
+            continue;
+        for (int j = i; j < count; j++) {
+            if (targets[j] != targets[i])
+                continue;
+            jobs[n].on_job = _pool_on_accepted;
+            jobs[n].userdata1 = listener;
+            jobs[n].userdata2 = (void *) (long) fds[j];
+            jobs[n].userdata3 = NULL;
+            jobs[n].on_drop = _pool_on_accept_dropped;
+            n++;
+            if (j != i) targets[j] = NULL;
+        }
+
+        __atomic_add_fetch(&listener->refs, (int) n, __ATOMIC_RELAXED);
+        if (event_loop_add_jobs(targets[i], jobs, n) != 0) {
+            for (size_t k = 0; k < n; k++)
+                _pool_on_accept_dropped(targets[i], listener, jobs[k].userdata2, NULL);
+        }
+    }
+    return 0;
+}
+
 struct event_loop_pool *event_loop_pool_create(unsigned int number)
+{
+    struct event_loop_pool_options options;
+
+    memset(&options, 0, sizeof(options));
+    options.thread_number = number;
+    return event_loop_pool_create_with_options(&options);
+}
+
+/* cpus the process may run on, in order, 0 when unknown */
+static unsigned int _pool_allowed_cpus(unsigned int *cpus, unsigned int max)
+{
+    unsigned int count = 0;
+#if defined(__linux__)
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) != 0)
+        return 0;
+    for (unsigned int cpu = 0; cpu < CPU_SETSIZE && count < max; cpu++) {
+        if (CPU_ISSET(cpu, &set))
+            cpus[count++] = cpu;
+    }
+#endif
+    return count;
+}
+
+struct event_loop_pool *event_loop_pool_create_with_options(const struct event_loop_pool_options *options)
 {
     struct event_loop_pool *e_pool;
+    struct event_loop_options loop_options;
+    unsigned int allowed[MAX_LOOP];
+    unsigned int allowed_number = 0;
+    const unsigned int *cpus = NULL;
+    unsigned int cpu_number = 0;
+    unsigned int number = options ? options->thread_number : 0;
+    char name[16];
+
+    /* sizing and pinning both follow the process affinity unless cpus is given */
+    if (!(options && options->cpus && options->cpu_number > 0))
+        allowed_number = _pool_allowed_cpus(allowed, MAX_LOOP);
 
+    if (options && options->cpus && options->cpu_number > 0) {
+        cpus = options->cpus;
+        cpu_number = options->cpu_number;
+    } else if (options && options->is_pinned) {
+        if (allowed_number == 0)
+            return NULL;
+        cpus = allowed;
+        cpu_number = allowed_number;
+    }
+
+    /* one loop per cpu */
+    if (number == 0)        number = cpus ? cpu_number : allowed_number;
     if (number == 0)        number = 8;
     if (number > MAX_LOOP)  return NULL;
 
@@ -36,10 +283,28 @@ struct event_loop_pool *event_loop_pool_create(unsigned int number)
         if (pthread_mutex_init(&e_pool->mtx, NULL))
             goto ERROR;
 
+        e_pool->rings = (struct pool_ring **) calloc((size_t) number * number, sizeof(*e_pool->rings));
+        if (!e_pool->rings)
+            goto ERROR;
+        if (posix_memalign((void **) &e_pool->doorbells, CACHE_LINE, number * sizeof(*e_pool->doorbells)))
+            goto ERROR;
+        memset(e_pool->doorbells, 0, number * sizeof(*e_pool->doorbells));
+
         e_pool->number = number;
+        e_pool->policy = options ? options->policy : event_loop_pool_round_robin;
         e_pool->pos = 0;
         for (int i = 0; i < number; i++) {
-            e_pool->e_loops[i] = event_loop_create();
+            memset(&loop_options, 0, sizeof(loop_options));
+            if (cpus) {
+                loop_options.is_pinned = 1;
+                loop_options.cpu = cpus[i % cpu_number];
+            }
+            if (options && options->thread_name) {
+                snprintf(name, sizeof(name), "%.10s-%d", options->thread_name, i);
+                loop_options.name = name;
+            }
+
+            e_pool->e_loops[i] = event_loop_create_with_options(&loop_options);
             if (!e_pool->e_loops[i])
                 goto ERROR;
         }
@@ -56,32 +321,238 @@ EXIT:
 void event_loop_pool_delete(struct event_loop_pool **e_pool)
 {
     if (e_pool && *e_pool) {
+        /* 
+         * stop every loop before freeing any, a live acceptor may still pick
+         * or hand fds to any loop, their threads may still drain the rings.
+         */
         for (int i = 0; i < (*e_pool)->number; i++) {
             if ((*e_pool)->e_loops[i])
-                event_loop_delete((*e_pool)->e_loops[i]);
+                event_loop_stop((*e_pool)->e_loops[i]);
+        }
+        for (int i = 0; i < (*e_pool)->number; i++) {
+            if ((*e_pool)->e_loops[i])
+                event_loop_delete(&(*e_pool)->e_loops[i]);
         }
         pthread_mutex_destroy(&(*e_pool)->mtx);
 
+        /* listen fds belong to the caller, queued fds were closed with the loops */
+        while ((*e_pool)->listeners) {
+            struct pool_listener *listener = (*e_pool)->listeners;
+
+            (*e_pool)->listeners = listener->next;
+            _pool_listener_release(listener);
+        }
+
+        /* undelivered messages are dropped */
+        if ((*e_pool)->rings) {
+            for (size_t i = 0; i < (size_t) (*e_pool)->number * (*e_pool)->number; i++)
+                free((*e_pool)->rings[i]);
+            free((*e_pool)->rings);
+        }
+        free((*e_pool)->doorbells);
+
         free(*e_pool);
         *e_pool = NULL;
     }    
 }
 
-struct event_loop *event_loop_pool_next(struct event_loop_pool *e_pool)
+/* busy first, loops within 1/32 of each other compare by channels */
+static int _pool_is_lighter(const struct event_loop_load *a, const struct event_loop_load *b)
 {
-    struct event_loop *e_loop;
+    unsigned int diff = a->busy > b->busy ? a->busy - b->busy : b->busy - a->busy;
 
-    pthread_mutex_lock(&e_pool->mtx);
+    if (diff > 32)
+        return a->busy < b->busy;
+    return a->channels < b->channels;
+}
 
-    e_loop = e_pool->e_loops[e_pool->pos];
-    if (++e_pool->pos >= e_pool->number)
-        e_pool->pos = 0;
+static unsigned int _pool_least_connections(struct event_loop_pool *e_pool, unsigned int pos)
+{
+    unsigned int best = pos % e_pool->number;
+    struct event_loop_load load;
+    unsigned int channels;
 
-    pthread_mutex_unlock(&e_pool->mtx);
-    return e_loop;
+    /* start from a rotating index, so ties spread out */
+    event_loop_get_load(e_pool->e_loops[best], &load);
+    channels = load.channels;
+    for (unsigned int i = 1; i < e_pool->number && channels > 0; i++) {
+        unsigned int index = (pos + i) % e_pool->number;
+
+        event_loop_get_load(e_pool->e_loops[index], &load);
+        if (load.channels < channels) {
+            channels = load.channels;
+            best = index;
+        }
+    }
+    return best;
+}
+
+static unsigned int _pool_two_choices(struct event_loop_pool *e_pool, unsigned int pos)
+{
+    struct event_loop_load load_a, load_b;
+    unsigned int hash = pos * 2654435761u;
+    unsigned int a, b;
+
+    if (e_pool->number < 2)
+        return 0;
+
+    /* two distinct loops picked from the counter, no shared random state */
+    a = (hash >> 16) % e_pool->number;
+    b = (a + 1 + (hash & 0xffff) % (e_pool->number - 1)) % e_pool->number;
+
+    event_loop_get_load(e_pool->e_loops[a], &load_a);
+    event_loop_get_load(e_pool->e_loops[b], &load_b);
+    return _pool_is_lighter(&load_b, &load_a) ? b : a;
+}
+
+struct event_loop *event_loop_pool_next(struct event_loop_pool *e_pool)
+{
+    unsigned int pos = __atomic_fetch_add(&e_pool->pos, 1, __ATOMIC_RELAXED);
+    unsigned int index;
+
+    switch (e_pool->policy) {
+    case event_loop_pool_least_connections:
+        index = _pool_least_connections(e_pool, pos);
+        break;
+    case event_loop_pool_two_choices:
+        index = _pool_two_choices(e_pool, pos);
+        break;
+    default:
+        index = pos % e_pool->number;
+        break;
+    }
+    return e_pool->e_loops[index];
 }
 
 struct event_loop *event_loop_pool_get_girst(struct event_loop_pool *e_pool)
 {
     return e_pool->e_loops[0];
 }
+
+unsigned int event_loop_pool_get_number(struct event_loop_pool *e_pool)
+{
+    return e_pool->number;
+}
+
+struct event_loop *event_loop_pool_get(struct event_loop_pool *e_pool, unsigned int index)
+{
+    return index < e_pool->number ? e_pool->e_loops[index] : NULL;
+}
+
+void event_loop_pool_set_msg_proc(struct event_loop_pool *e_pool, event_loop_pool_msg_proc on_msg, void *userdata)
+{
+    e_pool->on_msg = on_msg;
+    e_pool->msg_userdata = userdata;
+}
+
+int event_loop_pool_send(struct event_loop_pool *e_pool, unsigned int from, unsigned int to, int type, void *data)
+{
+    struct pool_ring *ring;
+    struct pool_msg *msg;
+    unsigned int tail;
+
+    if (from >= e_pool->number || to >= e_pool->number)
+        return -1;
+
+    ring = _pool_ring(e_pool, from, to);
+    if (!ring)
+        return -1;
+
+    tail = ring->tail;
+    if (tail - ring->head_cache == RING_SIZE) {
+        ring->head_cache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (tail - ring->head_cache == RING_SIZE)
+            return -1;
+    }
+
+    msg = &ring->msgs[tail & RING_MASK];
+    msg->type = type;
+    msg->data = data;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+    /* one doorbell job per drain, however many messages are behind it */
+    if (__atomic_exchange_n(&e_pool->doorbells[to].rung, 1, __ATOMIC_SEQ_CST) == 0) {
+        if (event_loop_add_job(e_pool->e_loops[to], _pool_drain, e_pool, (void *) (size_t) to, NULL) != 0)
+            __atomic_store_n(&e_pool->doorbells[to].rung, 0, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+static int _pool_listen(struct event_loop_pool *e_pool, struct event_loop *e_loop, int is_local, int listen_fd, event_loop_pool_accept_proc on_accept, void *userdata)
+{
+    struct pool_listener *listener;
+
+    if (!e_loop || listen_fd == -1 || !on_accept)
+        return -1;
+
+    listener = (struct pool_listener *) calloc(1, sizeof(*listener));
+    if (!listener)
+        return -1;
+    listener->channel = event_channel_create();
+    if (!listener->channel) {
+        free(listener);
+        return -1;
+    }
+    listener->refs = 1;
+    listener->e_pool = e_pool;
+    listener->e_loop = e_loop;
+    listener->is_local = is_local;
+    listener->on_accept = on_accept;
+    listener->userdata = userdata;
+
+    event_channel_set_fd(listener->channel, listen_fd);
+    event_channel_add_mask(listener->channel, FD_MASK_READ);
+    event_channel_set_userdata(listener->channel, listener);
+    event_channel_set_read_proc(listener->channel, _pool_on_accept);
+
+    pthread_mutex_lock(&e_pool->mtx);
+    listener->next = e_pool->listeners;
+    e_pool->listeners = listener;
+    pthread_mutex_unlock(&e_pool->mtx);
+
+    if (event_loop_add_channel(listener->e_loop, listener->channel) != 0) {
+        event_loop_pool_unlisten(e_pool, listen_fd);
+        return -1;
+    }
+    return 0;
+}
+
+int event_loop_pool_listen(struct event_loop_pool *e_pool, int listen_fd, event_loop_pool_accept_proc on_accept, void *userdata)
+{
+    return _pool_listen(e_pool, event_loop_pool_next(e_pool), 0, listen_fd, on_accept, userdata);
+}
+
+int event_loop_pool_listen_on(struct event_loop_pool *e_pool, unsigned int index, int listen_fd, event_loop_pool_accept_proc on_accept, void *userdata)
+{
+    return _pool_listen(e_pool, event_loop_pool_get(e_pool, index), 1, listen_fd, on_accept, userdata);
+}
+
+int event_loop_pool_unlisten(struct event_loop_pool *e_pool, int listen_fd)
+{
+    struct pool_listener **prev, *listener = NULL;
+
+    pthread_mutex_lock(&e_pool->mtx);
+    for (prev = &e_pool->listeners; *prev; prev = &(*prev)->next) {
+        if (event_channel_get_fd((*prev)->channel) == listen_fd) {
+            listener = *prev;
+            *prev = listener->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&e_pool->mtx);
+
+    if (!listener)
+        return -1;
+
+    /* waits for the acceptor loop, accepted fds already queued still arrive */
+    if (event_loop_remove_channel(listener->e_loop, listener->channel) != 0) {
+        /* called on another loop thread, still listening */
+        pthread_mutex_lock(&e_pool->mtx);
+        listener->next = e_pool->listeners;
+        e_pool->listeners = listener;
+        pthread_mutex_unlock(&e_pool->mtx);
+        return -1;
+    }
+    _pool_listener_release(listener);
+    return 0;
+}
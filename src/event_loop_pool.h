@@ -5,10 +5,69 @@
 
 struct event_loop_pool;
 
+enum event_loop_pool_policy {
+    event_loop_pool_round_robin = 0,
+    /* fewest channels, scans every loop */
+    event_loop_pool_least_connections,
+    /* lighter of two loops by busy time then channels */
+    event_loop_pool_two_choices,
+};
+
+struct event_loop_pool_options {
+    /* 0 uses one loop per cpu of cpus or of sched_getaffinity, 8 if unknown */
+    unsigned int thread_number;
+    /* how event_loop_pool_next picks a loop */
+    enum event_loop_pool_policy policy;
+    /* pin loop i to cpus[i % cpu_number] */
+    const unsigned int *cpus;
+    unsigned int cpu_number;
+    /* without cpus, pin to the cpus of sched_getaffinity */
+    int is_pinned;
+    /* loop threads are named "<thread_name>-<index>" */
+    const char *thread_name;
+};
+
+/* runs on the thread of loop `e_loop`, in the order each sender sent */
+typedef int (*event_loop_pool_msg_proc)(struct event_loop_pool *e_pool, 
+                                        struct event_loop *e_loop,
+                                        unsigned int from,
+                                        int type,
+                                        void *data,
+                                        void *userdata);
+
+/* runs on the thread of `e_loop`, not 0 closes the fd */
+typedef int (*event_loop_pool_accept_proc)(struct event_loop_pool *e_pool,
+                                           struct event_loop *e_loop,
+                                           int fd,
+                                           void *userdata);
+
 struct event_loop_pool *event_loop_pool_create(unsigned int thread_number);
+struct event_loop_pool *event_loop_pool_create_with_options(const struct event_loop_pool_options *options);
 void event_loop_pool_delete(struct event_loop_pool **e_pool);
 
+/* lock-free, any thread */
 struct event_loop *event_loop_pool_next(struct event_loop_pool *e_pool);
 struct event_loop *event_loop_pool_get_girst(struct event_loop_pool *e_pool);
+unsigned int event_loop_pool_get_number(struct event_loop_pool *e_pool);
+struct event_loop *event_loop_pool_get(struct event_loop_pool *e_pool, unsigned int index);
+
+/* set before the first send */
+void event_loop_pool_set_msg_proc(struct event_loop_pool *e_pool, event_loop_pool_msg_proc on_msg, void *userdata);
+
+/* 
+ * lock-free send over the ring from loop `from` to loop `to`, must be called 
+ * on the thread of `from`, -1 when the ring is full.
+ */
+int event_loop_pool_send(struct event_loop_pool *e_pool, unsigned int from, unsigned int to, int type, void *data);
+
+/* 
+ * accept on one loop of the pool in batches and hand every fd to the next
+ * loop through its job queue, so accepting never waits for a busy loop.
+ * listen_fd must be non-blocking and stays owned by the caller.
+ */
+int event_loop_pool_listen(struct event_loop_pool *e_pool, int listen_fd, event_loop_pool_accept_proc on_accept, void *userdata);
+/* accept on loop `index` and run on_accept there, one SO_REUSEPORT fd per loop */
+int event_loop_pool_listen_on(struct event_loop_pool *e_pool, unsigned int index, int listen_fd, event_loop_pool_accept_proc on_accept, void *userdata);
+int event_loop_pool_unlisten(struct event_loop_pool *e_pool, int listen_fd);
 
-#endif
\ No newline at end of file
+#endif
@@ -8,6 +8,11 @@
  * This file is part of Eloop.
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+/* accept4 */
+#define _GNU_SOURCE
+#endif
+
 #include <string.h>
 #include <stdlib.h>
 
@@ -20,6 +25,9 @@
 #include <fcntl.h>
 #include <netinet/tcp.h>
 #include <errno.h>
+#if defined(__linux) || defined(__linux__)
+#include <linux/filter.h>
+#endif
 #elif defined(WIN32) || defined(_WIN32) 
 #include <winsock2.h>
 #include <ws2tcpip.h>
@@ -181,11 +189,47 @@ net_tcp_set_reuse(int fd)
 {
     int value = 1;
 
-    if (setsockopt(fd, IPPROTO_TCP, SO_REUSEADDR, &value, sizeof(value)) == -1)
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value)) == -1)
         return -1;
     return 0;
 }
 
+int 
+net_tcp_set_reuseport(int fd)
+{
+#if defined(SO_REUSEPORT)
+    int value = 1;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (const char *) &value, sizeof(value)) == -1)
+        return -1;
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+int 
+net_tcp_set_reuseport_cpu(int fd, unsigned int count)
+{
+#if (defined(__linux) || defined(__linux__)) && defined(SO_ATTACH_REUSEPORT_CBPF)
+    /* socket index = cpu of the softirq % count, in bind order of the group */
+    struct sock_filter code[] = {
+        {BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU},
+        {BPF_ALU | BPF_MOD | BPF_K, 0, 0, count},
+        {BPF_RET | BPF_A, 0, 0, 0},
+    };
+    struct sock_fprog prog = {sizeof(code) / sizeof(code[0]), code};
+
+    if (count == 0)
+        return -1;
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == -1)
+        return -1;
+    return 0;
+#else
+    return -1;
+#endif
+}
+
 int 
 net_tcp_set_delay(int fd)
 {
@@ -206,8 +250,8 @@ net_tcp_set_nodelay(int fd)
     return 0;
 }
 
-int 
-net_tcp_server(const char *addr, unsigned short port, int backlog, char *err, size_t err_length)
+static int 
+_tcp_server(const char *addr, unsigned short port, int backlog, int is_reuseport, char *err, size_t err_length)
 {
     struct sockaddr_in socket_addr = {0};
     int ret = 0, error = 0;
@@ -227,6 +271,12 @@ net_tcp_server(const char *addr, unsigned short port, int backlog, char *err, si
         goto EXIT;
     }
     net_tcp_set_reuse(fd);
+    if (is_reuseport && net_tcp_set_reuseport(fd)) {
+        error = net_get_last_error();
+        snprintf(err, err_length, "set_reuseport fail, error=%d", error);
+        net_fd_close(&fd);
+        goto EXIT;
+    }
 
     socket_addr.sin_family = AF_INET;
     socket_addr.sin_addr.s_addr = inet_addr(addr);
@@ -250,6 +300,18 @@ EXIT:
     return fd;
 }
 
+int 
+net_tcp_server(const char *addr, unsigned short port, int backlog, char *err, size_t err_length)
+{
+    return _tcp_server(addr, port, backlog, 0, err, err_length);
+}
+
+int 
+net_tcp_server_reuseport(const char *addr, unsigned short port, int backlog, char *err, size_t err_length)
+{
+    return _tcp_server(addr, port, backlog, 1, err, err_length);
+}
+
 int 
 net_tcp_accept(int fd, char *ip, size_t ip_length, unsigned short *port, char *err, size_t err_length)
 {
@@ -285,6 +347,66 @@ LOOP:
     return client_fd;
 }
 
+int 
+net_tcp_accept_batch(int fd, int *fds, struct net_peer *peers, int max, int *error)
+{
+    int count = 0;
+
+    *error = 0;
+    while (count < max) {
+        struct sockaddr_in addr = {0};
+        socklen_t addrlen = sizeof(addr);
+        /* without peers the kernel does not copy the address either */
+        struct sockaddr *paddr = peers ? (struct sockaddr *) &addr : NULL;
+        socklen_t *paddrlen = peers ? &addrlen : NULL;
+        int client_fd;
+
+#if defined(__linux) || defined(__linux__) || defined(__FreeBSD__)
+        client_fd = accept4(fd, paddr, paddrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+        client_fd = accept(fd, paddr, paddrlen);
+        if (client_fd != -1) {
+            int noblock_error = 0;
+
+            if (net_fd_set_noblock(client_fd, &noblock_error)) {
+                net_fd_close(&client_fd);
+                continue;
+            }
+#if !defined(WIN32) && !defined(_WIN32)
+            fcntl(client_fd, F_SETFD, FD_CLOEXEC);
+#endif
+        }
+#endif
+        if (client_fd == -1) {
+#if defined(__linux) || defined(__linux__) || defined(__APPLE__) || defined(__FreeBSD__)
+            /* the client gave up while queued */
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                *error = errno;
+#else
+            if (WSAGetLastError() != WSAEWOULDBLOCK)
+                *error = WSAGetLastError();
+#endif
+            break;
+        }
+
+        if (peers) {
+#if defined(__linux) || defined(__linux__) || defined(__APPLE__) || defined(__FreeBSD__)
+            inet_ntop(AF_INET, &addr.sin_addr, peers[count].ip, sizeof(peers[count].ip));
+#elif defined(WIN32) || defined(_WIN32)
+            char *peer_ip = inet_ntoa(addr.sin_addr);
+            if (peer_ip)  strncpy(peers[count].ip, peer_ip, sizeof(peers[count].ip) - 1);
+#endif
+            peers[count].port = ntohs(addr.sin_port);
+        }
+        fds[count++] = client_fd;
+    }
+
+    /* EMFILE and alike only fail when nothing was accepted */
+    return count == 0 && *error ? -1 : count;
+}
+
 int net_get_last_error()
 {
     int ret = 0;
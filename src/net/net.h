@@ -10,6 +10,12 @@ extern "C" {
 #if defined(__linux) || defined(__linux__) 
 #endif
 
+/* peer of an accepted connection */
+struct net_peer {
+    char ip[64];
+    unsigned short port;
+};
+
 int net_init();
 void net_finalize();
 
@@ -19,11 +25,21 @@ int net_fd_shutdown_read(int fd);
 int net_fd_shutdown_write(int fd);
 
 int net_tcp_set_reuse(int fd);
+int net_tcp_set_reuseport(int fd);
+/* linux, steer connections of a reuseport group to socket cpu % count */
+int net_tcp_set_reuseport_cpu(int fd, unsigned int count);
 int net_tcp_set_delay(int fd);
 int net_tcp_set_nodelay(int fd);
 
 int net_tcp_server(const char *addr, unsigned short port, int backlog, char *err, size_t err_length);
+/* SO_REUSEPORT, more servers of the same port share its connections */
+int net_tcp_server_reuseport(const char *addr, unsigned short port, int backlog, char *err, size_t err_length);
 int net_tcp_accept(int fd, char *ip, size_t ip_length, unsigned short *port, char *err, size_t err_length);
+/* 
+ * accept up to max non-blocking close-on-exec fds until EAGAIN, peers may be 
+ * NULL to skip the address. returns the count, -1 with error when none.
+ */
+int net_tcp_accept_batch(int fd, int *fds, struct net_peer *peers, int max, int *error);
 
 int net_fd_set_block_direct(int fd, char is_block, int *error);
 int net_fd_set_block(int fd, int *error);
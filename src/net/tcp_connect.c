@@ -14,19 +14,107 @@
 
 #include "tcp_connect.h"
 #include "net.h"
+#include "../event_io.h"
+
+#define RECV_LENGTH     4096
+/* timeout timers may fire this fraction late to share wakeups */
+#define TIMEOUT_SLACK_SHIFT 4
 
 struct tcp_connect {
     struct event_channel *channel;
     struct event_loop *e_loop;
     tcp_connect_proc procs[PROC_END_OF];
     void *userdata;
+
+    /* edge-triggered, write interest stays registered */
+    char is_edge;
+    char is_writing;
+    /* backend receives into recv pipe */
+    char is_recv;
+
+    /* timeouts, the timer only checks the activity stamps when it fires */
+    unsigned int idle_timeout;
+    unsigned int read_timeout;
+    unsigned int write_timeout;
+    unsigned long long read_at;
+    unsigned long long write_at;
+    long long timer_id;
+    /* deadline the timer was armed for */
+    unsigned long long timer_deadline;
+    /* deleted from another loop thread, the own loop finishes it */
+    char is_deleted;
+    /* flush jobs queued to the loop, the last one frees a deleted connect */
+    int job_count;
 };
 
+/* earliest deadline from the activity stamps, 0 without timeout */
+static unsigned long long 
+_tcp_connect_deadline(struct tcp_connect *connect, unsigned long long now)
+{
+    unsigned long long deadline = ~0ULL;
+    unsigned long long active_at = connect->read_at > connect->write_at ? connect->read_at : connect->write_at;
+
+    if (connect->idle_timeout && active_at + connect->idle_timeout < deadline)
+        deadline = active_at + connect->idle_timeout;
+    if (connect->read_timeout && connect->read_at + connect->read_timeout < deadline)
+        deadline = connect->read_at + connect->read_timeout;
+    /* only while data is pending, tcp_connect_mark_write arms it again */
+    if (connect->write_timeout && buffer_pipe_get_length(event_channel_get_send_pipe(connect->channel)) > 0) {
+        if (connect->write_at + connect->write_timeout < deadline)
+            deadline = connect->write_at + connect->write_timeout;
+    }
+
+    return deadline == ~0ULL ? 0 : deadline;
+}
+
+static int _tcp_connec_on_close(struct event_channel *channel);
+
+static int 
+_tcp_connect_on_timer(struct event_loop *e_loop, long long id, void *userdata);
+
+static void 
+_tcp_connect_arm(struct tcp_connect *connect, unsigned long long now)
+{
+    unsigned long long deadline = _tcp_connect_deadline(connect, now);
+    struct event_loop_timer_options options = {0};
+
+    if (deadline == 0)
+        return;
+
+    options.interval_ms = deadline > now ? (unsigned int) (deadline - now) : 0;
+    options.type = timer_type_one_shot;
+    options.slack_ms = options.interval_ms >> TIMEOUT_SLACK_SHIFT;
+    connect->timer_id = event_loop_add_timer_with_options(connect->e_loop, &options, _tcp_connect_on_timer, connect);
+    connect->timer_deadline = deadline;
+}
+
+static int 
+_tcp_connect_on_timer(struct event_loop *e_loop, long long id, void *userdata)
+{
+    struct tcp_connect *connect = (struct tcp_connect *) userdata;
+    unsigned long long now = event_loop_now(e_loop);
+    unsigned long long deadline = _tcp_connect_deadline(connect, now);
+
+    connect->timer_id = 0;
+    if (__atomic_load_n(&connect->is_deleted, __ATOMIC_ACQUIRE))
+        return 0;
+    if (deadline != 0 && deadline <= now) {
+        _tcp_connec_on_close(connect->channel);
+        return 0;
+    }
+
+    /* there was activity, wait for the new deadline */
+    _tcp_connect_arm(connect, now);
+    return 0;
+}
+
 static int 
 _tcp_connec_on_close(struct event_channel *channel)
 {
     struct tcp_connect *connect = (struct tcp_connect *) event_channel_get_userdata(channel);
 
+    if (__atomic_load_n(&connect->is_deleted, __ATOMIC_ACQUIRE))
+        return 0;
     if (connect->procs[PROC_CLOSE]) connect->procs[PROC_CLOSE](connect);
     else                            tcp_connect_delete(&connect);
     return 0;
@@ -37,6 +125,12 @@ _tcp_connec_on_write(struct event_channel *channel)
 {
     struct tcp_connect *connect = (struct tcp_connect *) event_channel_get_userdata(channel);
 
+    /* edge notifies writable even without pending data */
+    if (connect->is_edge && !connect->is_writing)
+        return 0;
+    if (__atomic_load_n(&connect->is_deleted, __ATOMIC_ACQUIRE))
+        return 0;
+
     if (connect->procs[PROC_WRITE]) connect->procs[PROC_WRITE](connect);
     return 0;
 }
@@ -45,7 +139,7 @@ static int
 _tcp_connec_on_read(struct event_channel *channel)
 {
     int ret = 0;
-    char buffer[1024];
+    char *buffer;
     int fd = event_channel_get_fd(channel);
     struct tcp_connect *connect = (struct tcp_connect *) event_channel_get_userdata(channel);
     struct buffer_pipe *pipe_recv = event_channel_get_recv_pipe(channel);
@@ -54,18 +148,21 @@ _tcp_connec_on_read(struct event_channel *channel)
     char need_close = 0;
     int error = 0;
 
+    if (__atomic_load_n(&connect->is_deleted, __ATOMIC_ACQUIRE))
+        return 0;
+
     while (reading) {
-        /* read from socket */
-        ret = net_fd_read(fd, buffer, sizeof(buffer), &error);
+        /* read from socket into the tail of pipe */
+        buffer = buffer_pipe_reserve(pipe_recv, RECV_LENGTH);
+        if (!buffer) {
+            need_close = 1;
+            break;
+        }
+
+        ret = net_fd_read(fd, buffer, RECV_LENGTH, &error);
         if (ret > 0) {
-            /* write */
-            ret = buffer_pipe_write(pipe_recv, buffer, (size_t) ret);
-            if (ret == 0)
-                has_data = 1;
-            else {
-                reading = 0;
-                need_close = 1;
-            }
+            buffer_pipe_commit(pipe_recv, (size_t) ret);
+            has_data = 1;
         } else if (ret == 0) {
             reading = 0;
             need_close = 1;
@@ -78,6 +175,7 @@ _tcp_connec_on_read(struct event_channel *channel)
     }
 
     if (has_data == 1) {
+        connect->read_at = event_loop_now(connect->e_loop);
         if (connect->procs[PROC_READ])  ret = connect->procs[PROC_READ](connect);
         if (ret == 1)                   need_close  = 0;
     }
@@ -90,11 +188,41 @@ _tcp_connec_on_read(struct event_channel *channel)
     return ret;
 }
 
+/* completion mode, backend has received into the pipe, eof and error come as close */
+static int 
+_tcp_connec_on_recv(struct event_channel *channel)
+{
+    int ret = 0;
+    struct tcp_connect *connect = (struct tcp_connect *) event_channel_get_userdata(channel);
+
+    if (__atomic_load_n(&connect->is_deleted, __ATOMIC_ACQUIRE))
+        return 0;
+    if (buffer_pipe_get_length(event_channel_get_recv_pipe(channel)) > 0) {
+        connect->read_at = event_loop_now(connect->e_loop);
+        if (connect->procs[PROC_READ])
+            ret = connect->procs[PROC_READ](connect);
+    }
+
+    if (ret < 0)
+        ret = -1;
+    return ret;
+}
+
 struct tcp_connect *tcp_connect_create(int fd, 
                                             struct event_loop *e_loop, 
                                             tcp_connect_proc read_proc, 
                                             tcp_connect_proc write_proc, 
                                             tcp_connect_proc close_proc)
+{
+    return tcp_connect_create_with_options(fd, e_loop, read_proc, write_proc, close_proc, NULL);
+}
+
+struct tcp_connect *tcp_connect_create_with_options(int fd, 
+                                            struct event_loop *e_loop, 
+                                            tcp_connect_proc read_proc, 
+                                            tcp_connect_proc write_proc, 
+                                            tcp_connect_proc close_proc,
+                                            const struct tcp_connect_options *options)
 {
     struct tcp_connect *connect = (struct tcp_connect *) calloc(1, sizeof(*connect));
 
@@ -110,14 +238,36 @@ struct tcp_connect *tcp_connect_create(int fd,
         connect->procs[PROC_READ] = read_proc;
         connect->procs[PROC_WRITE] = write_proc;
         connect->procs[PROC_CLOSE] = close_proc;
+        if (options && options->is_edge && (event_loop_get_io_features(e_loop) & EVENT_IO_FEATURE_EDGE))
+            connect->is_edge = 1;
+        if (options && options->is_recv && (event_loop_get_io_features(e_loop) & EVENT_IO_FEATURE_RECV))
+            connect->is_recv = 1;
+        if (options) {
+            connect->idle_timeout = options->idle_timeout_ms;
+            connect->read_timeout = options->read_timeout_ms;
+            connect->write_timeout = options->write_timeout_ms;
+        }
 
         event_channel_set_fd(channel, fd);
         event_channel_set_userdata(channel, connect);
         tcp_connect_mark_read(connect);
+        if (connect->is_edge) {
+            event_channel_add_mask(channel, FD_MASK_WRITE | FD_MASK_EDGE);
+            event_channel_set_write_proc(channel, _tcp_connec_on_write);
+        }
+        if (connect->is_recv)
+            event_channel_add_mask(channel, FD_MASK_RECV);
+
+        /* before the channel goes live, the loop may run it at once */
+        connect->read_at = connect->write_at = event_loop_now(e_loop);
+        _tcp_connect_arm(connect, connect->read_at);
 
         if (event_loop_add_channel(e_loop, channel) != 0) {
+            if (connect->timer_id > 0)
+                event_loop_remove_timer(e_loop, connect->timer_id);
             connect->e_loop = NULL;
             tcp_connect_delete(&connect);
+            goto EXIT;
         }
     }
 
@@ -125,19 +275,72 @@ EXIT:
     return connect;
 }
 
+/* edge mode flush on the loop thread, through the write proc like a writable edge */
+static int _tcp_connect_on_flush(struct event_loop *e_loop, void *userdata1, void *userdata2, void *userdata3)
+{
+    struct tcp_connect *connect = (struct tcp_connect *) userdata1;
+
+    if (__atomic_sub_fetch(&connect->job_count, 1, __ATOMIC_ACQ_REL) == 0 && !connect->channel) {
+        free(connect);
+        return 0;
+    }
+    if (!connect->channel)
+        return 0;
+
+    if (connect->procs[PROC_WRITE])
+        _tcp_connec_on_write(connect->channel);
+    else if (connect->is_writing && tcp_connect_write(connect) == -1)
+        _tcp_connec_on_close(connect->channel);
+    return 0;
+}
+
+/* the loop is deleted, nothing to flush to */
+static int _tcp_connect_on_flush_dropped(struct event_loop *e_loop, void *userdata1, void *userdata2, void *userdata3)
+{
+    struct tcp_connect *connect = (struct tcp_connect *) userdata1;
+
+    if (__atomic_sub_fetch(&connect->job_count, 1, __ATOMIC_ACQ_REL) == 0 && !connect->channel)
+        free(connect);
+    return 0;
+}
+
+static int _tcp_connect_on_delete(struct event_loop *e_loop, void *userdata1, void *userdata2, void *userdata3)
+{
+    struct tcp_connect *connect = (struct tcp_connect *) userdata1;
+
+    tcp_connect_delete(&connect);
+    return 0;
+}
+
 void tcp_connect_delete(struct tcp_connect **connectp)
 {
     if (connectp && *connectp) {
         struct tcp_connect *connect = *connectp;
         int fd = event_channel_get_fd(connect->channel);
 
-        if (connect->e_loop && connect->channel)
-            event_loop_remove_channel(connect->e_loop, connect->channel);
+        if (connect->e_loop && connect->timer_id > 0) {
+            event_loop_remove_timer(connect->e_loop, connect->timer_id);
+            connect->timer_id = 0;
+        }
+        if (connect->e_loop && connect->channel
+            && event_loop_remove_channel(connect->e_loop, connect->channel) != 0
+            && errno == EDEADLK) {
+            struct event_loop_job job = {_tcp_connect_on_delete, connect, NULL, NULL, _tcp_connect_on_delete};
+
+            /* on the thread of another loop, finish on its own loop, no proc runs meanwhile */
+            __atomic_store_n(&connect->is_deleted, 1, __ATOMIC_RELEASE);
+            if (event_loop_add_jobs(connect->e_loop, &job, 1) == 0) {
+                *connectp = NULL;
+                return;
+            }
+        }
         if (connect->channel) {
             net_fd_close(&fd);
             event_channel_delete(&(connect->channel));
         }
-        free(connect);
+        /* a queued flush still points here, it frees the rest */
+        if (__atomic_load_n(&connect->job_count, __ATOMIC_ACQUIRE) == 0)
+            free(connect);
         *connectp = NULL;
     }
 }
@@ -159,10 +362,13 @@ int tcp_connect_write(struct tcp_connect *connect)
             ret = net_fd_write(event_channel_get_fd(channel), buffer, length);
             if (ret > 0) {
                 size_t actual_write_len = (size_t) ret;
+
+                connect->write_at = event_loop_now(connect->e_loop);
                 if (actual_write_len < length) {
-                    /* write remain data to head and wait for next write */
+                    /* write remain data to head and wait for next write, edge drains until EAGAIN */
                     buffer_pipe_write_head(pipe_send, buffer + actual_write_len, length - actual_write_len);
-                    break;
+                    if (!connect->is_edge)
+                        break;
                 }
             } else if (ret == 0) {
                 close_fd = 1;
@@ -173,6 +379,10 @@ int tcp_connect_write(struct tcp_connect *connect)
                     close_fd = 1;
                     break;
                 }
+                /* keep data and wait for writable */
+                buffer_pipe_write_head(pipe_send, buffer, length);
+                ret = 0;
+                break;
             }
         } else {
             remain_data = 0;
@@ -193,13 +403,46 @@ int tcp_connect_write(struct tcp_connect *connect)
 int tcp_connect_mark_read(struct tcp_connect *connect)
 {
     event_channel_add_mask(connect->channel, FD_MASK_READ | FD_MASK_ERROR);
-    event_channel_set_read_proc(connect->channel, _tcp_connec_on_read);
-    event_channel_set_close_proc(connect->e_loop, _tcp_connec_on_close);  
+    event_channel_set_read_proc(connect->channel, connect->is_recv ? _tcp_connec_on_recv : _tcp_connec_on_read);
+    event_channel_set_close_proc(connect->channel, _tcp_connec_on_close);  
     return 0;
 }
 
 int tcp_connect_mark_write(struct tcp_connect *connect)
 {
+    /* write timeout counts from the start of pending data */
+    if (connect->is_edge ? !connect->is_writing : !event_channel_is_exist_mask(connect->channel, FD_MASK_WRITE)) {
+        connect->write_at = event_loop_now(connect->e_loop);
+
+        /* idle connections have no write deadline, start it now */
+        if (connect->write_timeout
+            && (connect->timer_id <= 0 || connect->write_at + connect->write_timeout < connect->timer_deadline)) {
+            if (connect->timer_id > 0)
+                event_loop_remove_timer(connect->e_loop, connect->timer_id);
+            connect->timer_id = 0;
+            _tcp_connect_arm(connect, connect->write_at);
+        }
+    }
+
+    if (connect->is_edge) {
+        /* 
+         * writable edge may already be consumed, flush from the loop through the
+         * write proc and wait for the next edge on EAGAIN, one flush queued at most.
+         */
+        struct event_loop_job job = {_tcp_connect_on_flush, connect, NULL, NULL, _tcp_connect_on_flush_dropped};
+
+        if (connect->is_writing)
+            return 0;
+        connect->is_writing = 1;
+        __atomic_add_fetch(&connect->job_count, 1, __ATOMIC_ACQ_REL);
+        if (event_loop_add_jobs(connect->e_loop, &job, 1) != 0) {
+            __atomic_sub_fetch(&connect->job_count, 1, __ATOMIC_ACQ_REL);
+            connect->is_writing = 0;
+            return -1;
+        }
+        return 0;
+    }
+
     event_channel_add_mask(connect->channel, FD_MASK_WRITE);
     event_channel_set_write_proc(connect->channel, _tcp_connec_on_write);
     event_loop_update_channel(connect->e_loop, connect->channel);
@@ -208,6 +451,11 @@ int tcp_connect_mark_write(struct tcp_connect *connect)
 
 int tcp_connect_unmark_write(struct tcp_connect *connect)
 {
+    if (connect->is_edge) {
+        connect->is_writing = 0;
+        return 0;
+    }
+
     event_channel_remove_mask(connect->channel, FD_MASK_WRITE);
     event_channel_set_write_proc(connect->channel, NULL);
     event_loop_update_channel(connect->e_loop, connect->channel);
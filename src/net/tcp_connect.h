@@ -12,11 +12,40 @@ struct tcp_connect;
 
 typedef int (*tcp_connect_proc)(struct tcp_connect *connect);
 
+struct tcp_connect_options {
+    /* 
+     * edge-triggered when the backend supports it, fd is registered once 
+     * and mark/unmark write only switch the write proc.
+     */
+    int is_edge;
+    /* 
+     * completion-based read when the backend supports it, kernel receives into 
+     * loop-owned buffers which are copied to the recv pipe before read proc.
+     * it saves the readiness wakeup and read syscall, not a copy, the readiness
+     * path reads into the pipe directly.
+     */
+    int is_recv;
+    /* 
+     * milliseconds, 0 disables. idle counts from the last read or write, read 
+     * from the last received data, write from the last progress of pending 
+     * send data. expiry calls the close proc.
+     */
+    unsigned int idle_timeout_ms;
+    unsigned int read_timeout_ms;
+    unsigned int write_timeout_ms;
+};
+
 struct tcp_connect *tcp_connect_create(int fd, 
                                             struct event_loop *e_loop, 
                                             tcp_connect_proc read_proc, 
                                             tcp_connect_proc write_proc, 
                                             tcp_connect_proc close_proc);
+struct tcp_connect *tcp_connect_create_with_options(int fd, 
+                                            struct event_loop *e_loop, 
+                                            tcp_connect_proc read_proc, 
+                                            tcp_connect_proc write_proc, 
+                                            tcp_connect_proc close_proc,
+                                            const struct tcp_connect_options *options);
 void tcp_connect_delete(struct tcp_connect **connectp);
 
 int tcp_connect_write(struct tcp_connect *connect);
@@ -9,12 +9,20 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
 
 #include "tcp_server.h"
 #include "net.h"
 
 struct tcp_server {
     int fd;
+
+    /* listeners of a pool server, fds[0] is fd */
+    struct event_loop_pool *e_pool;
+    int *fds;
+    unsigned int fd_count;
+    /* fds[0, listen_count) are registered on the pool */
+    unsigned int listen_count;
 };
 
 struct tcp_server *
@@ -33,12 +41,76 @@ tcp_server_open(const char *addr, unsigned short port, int backlog, char *err, s
     return server;
 }
 
+struct tcp_server *
+tcp_server_open_on_pool(struct event_loop_pool *e_pool, 
+                        const char *addr, 
+                        unsigned short port, 
+                        int backlog, 
+                        const struct tcp_server_options *options,
+                        event_loop_pool_accept_proc on_accept,
+                        void *userdata,
+                        char *err, 
+                        size_t err_length)
+{
+    unsigned int number = event_loop_pool_get_number(e_pool);
+    struct tcp_server *server = (struct tcp_server *) calloc(1, sizeof(*server));
+
+    if (!server)
+        goto FAIL;
+    server->fd = -1;
+    server->fds = (int *) malloc(number * sizeof(*server->fds));
+    if (!server->fds)
+        goto FAIL;
+
+    /* bind order is the socket index the steering program returns */
+    for (unsigned int i = 0; i < number; i++) {
+        int fd = net_tcp_server_reuseport(addr, port, backlog, err, err_length);
+
+        if (fd == -1)
+            goto FAIL;
+        server->fds[server->fd_count++] = fd;
+    }
+    server->fd = server->fds[0];
+
+    if (options && options->is_reuseport_cpu && net_tcp_set_reuseport_cpu(server->fd, number) != 0) {
+        snprintf(err, err_length, "set_reuseport_cpu fail, error=%d", net_get_last_error());
+        goto FAIL;
+    }
+
+    server->e_pool = e_pool;
+    for (unsigned int i = 0; i < number; i++) {
+        if (event_loop_pool_listen_on(e_pool, i, server->fds[i], on_accept, userdata) != 0) {
+            snprintf(err, err_length, "listen on loop %u fail", i);
+            goto FAIL;
+        }
+        server->listen_count++;
+    }
+
+    goto EXIT;
+FAIL:
+    tcp_server_close(&server);
+EXIT:
+    return server;
+}
+
 void 
 tcp_server_close(struct tcp_server **serverp)
 {
     if (serverp && *serverp) {
-        net_fd_close((*serverp)->fd);
-        free(*serverp);
+        struct tcp_server *server = *serverp;
+
+        if (server->fds) {
+            for (unsigned int i = 0; i < server->fd_count; i++) {
+                /* unlisten waits for the loop, a fd it still polls stays open */
+                if (i < server->listen_count && event_loop_pool_unlisten(server->e_pool, server->fds[i]) != 0)
+                    continue;
+                net_fd_close(&server->fds[i]);
+            }
+            free(server->fds);
+        } else if (server->fd != -1) {
+            net_fd_close(&server->fd);
+        }
+        free(server);
         *serverp = NULL;
     }
 }
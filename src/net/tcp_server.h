@@ -5,11 +5,39 @@
 extern "C" {
 #endif
 
+#include "../event_loop_pool.h"
+
 struct tcp_server;
 
+struct tcp_server_options {
+    /* 
+     * linux, steer every connection to the listener of loop cpu % loops, 
+     * with loop i pinned to cpu i accept and handler stay on the softirq cpu.
+     */
+    int is_reuseport_cpu;
+};
+
 struct tcp_server *tcp_server_open(const char *addr, unsigned short port, int backlog, char *err, size_t err_length);
+/* 
+ * one SO_REUSEPORT listener per loop of the pool, every loop accepts its own
+ * connections and on_accept runs on it, no thread in between.
+ */
+struct tcp_server *tcp_server_open_on_pool(struct event_loop_pool *e_pool, 
+                                           const char *addr, 
+                                           unsigned short port, 
+                                           int backlog, 
+                                           const struct tcp_server_options *options,
+                                           event_loop_pool_accept_proc on_accept,
+                                           void *userdata,
+                                           char *err, 
+                                           size_t err_length);
+/* 
+ * close a pool server off its loops, a listener another loop still polls
+ * can't be removed from a loop thread and its fd is left open.
+ */
 void tcp_server_close(struct tcp_server **serverp);
 
+/* the first listener of a pool server */
 int tcp_server_get_fd(struct tcp_server *server);
 
 #ifdef __cplusplus
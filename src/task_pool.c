@@ -0,0 +1,454 @@
+/*
+ * task pool
+ *
+ * Copyright (c) 2024 kyleliu <justfavme at gmail dot com>
+ * All rights reserved.
+ *
+ * This file is part of Eloop.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <pthread.h>
+
+#include "task_pool.h"
+
+#define TASK_THREADS_DEFAULT    4
+#define TASK_THREADS_MAX        256
+/* initial deque capacity, power of 2 */
+#define TASK_DEQUE_SIZE         256
+
+struct task {
+    struct task *next;
+    task_pool_work_proc on_work;
+    task_pool_done_proc on_done;
+    struct event_loop *eloop;
+    void *userdata;
+    void *result;
+};
+
+/* circular buffer of a deque, replaced by a doubled one when full */
+struct task_array {
+    long long size;
+    struct task_array *retired;
+    struct task *tasks[];
+};
+
+/*
+ * chase-lev deque, the owner pushes and takes at bottom, thieves steal at
+ * top. outgrown arrays stay on the retired list until delete, a thief may
+ * still be reading one.
+ */
+struct task_deque {
+    long long top;
+    long long bottom;
+    struct task_array *array;
+};
+
+struct task_worker {
+    struct task_pool *pool;
+    unsigned int index;
+    pthread_t thread_fd;
+    int is_thread_ready;
+    unsigned int seed;
+
+    struct task_deque deque;
+    /* lock-free stack pushed by other threads, taken whole by any worker */
+    struct task *inbox;
+};
+
+struct task_pool {
+    struct task_worker *workers;
+    unsigned int number;
+    unsigned int next;
+
+    /* tasks queued but not taken yet, idle workers sleep while 0 */
+    long long pending;
+    int sleepers;
+    int thread_abort;
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+};
+
+static pthread_key_t _worker_key;
+static pthread_once_t _worker_once = PTHREAD_ONCE_INIT;
+
+static void
+_worker_key_init(void)
+{
+    pthread_key_create(&_worker_key, NULL);
+}
+
+static struct task_array *
+_array_create(long long size)
+{
+    struct task_array *array = (struct task_array *) calloc(1, sizeof(*array) + size * sizeof(struct task *));
+
+    if (array)
+        array->size = size;
+    return array;
+}
+
+static struct task *
+_array_get(struct task_array *array, long long i)
+{
+    return __atomic_load_n(&array->tasks[i & (array->size - 1)], __ATOMIC_RELAXED);
+}
+
+static void
+_array_put(struct task_array *array, long long i, struct task *task)
+{
+    __atomic_store_n(&array->tasks[i & (array->size - 1)], task, __ATOMIC_RELAXED);
+}
+
+static int
+_deque_init(struct task_deque *deque)
+{
+    deque->top = deque->bottom = 0;
+    deque->array = _array_create(TASK_DEQUE_SIZE);
+    return deque->array ? 0 : -1;
+}
+
+static void
+_deque_destroy(struct task_deque *deque)
+{
+    struct task_array *array = deque->array;
+
+    while (array) {
+        struct task_array *retired = array->retired;
+
+        free(array);
+        array = retired;
+    }
+    deque->array = NULL;
+}
+
+/* owner only */
+static int
+_deque_push(struct task_deque *deque, struct task *task)
+{
+    long long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    long long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    struct task_array *array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+
+    if (bottom - top > array->size - 1) {
+        struct task_array *bigger = _array_create(array->size * 2);
+
+        if (!bigger)
+            return -1;
+        for (long long i = top; i < bottom; i++)
+            _array_put(bigger, i, _array_get(array, i));
+        bigger->retired = array;
+        __atomic_store_n(&deque->array, bigger, __ATOMIC_RELEASE);
+        array = bigger;
+    }
+
+    _array_put(array, bottom, task);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* owner only, newest first */
+static struct task *
+_deque_take(struct task_deque *deque)
+{
+    long long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    struct task_array *array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+    struct task *task = NULL;
+    long long top;
+
+    __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+    if (top <= bottom) {
+        task = _array_get(array, bottom);
+        if (top == bottom) {
+            /* the last one, race the thieves for it */
+            if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+                task = NULL;
+            __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+        }
+    } else {
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+    return task;
+}
+
+/* any thread, oldest first, NULL when empty or lost the race */
+static struct task *
+_deque_steal(struct task_deque *deque)
+{
+    long long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    long long bottom;
+    struct task *task;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+    if (top >= bottom)
+        return NULL;
+
+    task = _array_get(__atomic_load_n(&deque->array, __ATOMIC_ACQUIRE), top);
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return NULL;
+    return task;
+}
+
+static void
+_inbox_push(struct task_worker *worker, struct task *task)
+{
+    struct task *head = __atomic_load_n(&worker->inbox, __ATOMIC_RELAXED);
+
+    do {
+        task->next = head;
+    } while (!__atomic_compare_exchange_n(&worker->inbox, &head, task, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* move a whole inbox into the deque of self, oldest ends up at top */
+static int
+_inbox_take(struct task_worker *self, struct task_worker *from)
+{
+    struct task *tasks = __atomic_exchange_n(&from->inbox, NULL, __ATOMIC_ACQUIRE);
+    struct task *first = NULL;
+    int ret = 0;
+
+    if (!tasks)
+        return ret;
+
+    while (tasks) {
+        struct task *next = tasks->next;
+
+        tasks->next = first;
+        first = tasks;
+        tasks = next;
+    }
+
+    while (first) {
+        struct task *next = first->next;
+
+        /* no memory to grow, hand the rest back */
+        if (_deque_push(&self->deque, first) != 0) {
+            while (first) {
+                next = first->next;
+                _inbox_push(self, first);
+                first = next;
+            }
+            break;
+        }
+        first = next;
+        ret++;
+    }
+    return ret;
+}
+
+static int
+_task_on_done(struct event_loop *eloop, void *userdata1, void *userdata2, void *userdata3)
+{
+    struct task *task = (struct task *) userdata1;
+
+    task->on_done(eloop, task->result, task->userdata);
+    free(task);
+    return 0;
+}
+
+/* the loop was deleted first, on_done gets no loop and only releases */
+static int
+_task_on_dropped(struct event_loop *eloop, void *userdata1, void *userdata2, void *userdata3)
+{
+    return _task_on_done(NULL, userdata1, userdata2, userdata3);
+}
+
+static void
+_task_run(struct task_pool *pool, struct task *task)
+{
+    __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+
+    task->result = task->on_work(task->userdata);
+    if (task->eloop && task->on_done) {
+        struct event_loop_job job = {_task_on_done, task, NULL, NULL, _task_on_dropped};
+
+        if (event_loop_add_jobs(task->eloop, &job, 1) == 0)
+            return;
+    }
+    free(task);
+}
+
+static struct task *
+_task_find(struct task_worker *self)
+{
+    struct task_pool *pool = self->pool;
+    struct task *task = _deque_take(&self->deque);
+
+    if (task)
+        return task;
+
+    if (_inbox_take(self, self) > 0)
+        return _deque_take(&self->deque);
+
+    /* start at a random victim, so thieves spread out */
+    self->seed = self->seed * 1103515245 + 12345;
+    for (unsigned int i = 0, start = (self->seed >> 16) % pool->number; i < pool->number; i++) {
+        struct task_worker *victim = &pool->workers[(start + i) % pool->number];
+
+        if (victim == self)
+            continue;
+        task = _deque_steal(&victim->deque);
+        if (task)
+            return task;
+        /* its owner is busy, take the whole inbox */
+        if (_inbox_take(self, victim) > 0)
+            return _deque_take(&self->deque);
+    }
+    return NULL;
+}
+
+static void *
+_thread_func(void *userdata)
+{
+    struct task_worker *self = (struct task_worker *) userdata;
+    struct task_pool *pool = self->pool;
+
+    pthread_setspecific(_worker_key, self);
+
+    while (!__atomic_load_n(&pool->thread_abort, __ATOMIC_ACQUIRE)) {
+        struct task *task = _task_find(self);
+
+        if (task) {
+            _task_run(pool, task);
+            continue;
+        }
+
+        /* pending is raised before sleepers is read by submit */
+        pthread_mutex_lock(&pool->mtx);
+        __atomic_add_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) == 0 && !pool->thread_abort)
+            pthread_cond_wait(&pool->cond, &pool->mtx);
+        __atomic_sub_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&pool->mtx);
+    }
+    return (void *) 0;
+}
+
+struct task_pool *
+task_pool_create(unsigned int number)
+{
+    struct task_pool *pool;
+
+    if (number == 0)                number = TASK_THREADS_DEFAULT;
+    if (number > TASK_THREADS_MAX)  return NULL;
+
+    pthread_once(&_worker_once, _worker_key_init);
+
+    pool = (struct task_pool *) calloc(1, sizeof(*pool));
+    if (!pool)
+        goto FAIL;
+    if (pthread_mutex_init(&pool->mtx, NULL))
+        goto FAIL;
+    if (pthread_cond_init(&pool->cond, NULL))
+        goto FAIL;
+
+    pool->workers = (struct task_worker *) calloc(number, sizeof(*pool->workers));
+    if (!pool->workers)
+        goto FAIL;
+    pool->number = number;
+    for (unsigned int i = 0; i < number; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        pool->workers[i].seed = i + 1;
+        if (_deque_init(&pool->workers[i].deque) != 0)
+            goto FAIL;
+    }
+
+    for (unsigned int i = 0; i < number; i++) {
+        if (pthread_create(&pool->workers[i].thread_fd, NULL, _thread_func, &pool->workers[i]))
+            goto FAIL;
+        pool->workers[i].is_thread_ready = 1;
+    }
+
+    goto EXIT;
+FAIL:
+    task_pool_delete(&pool);
+EXIT:
+    return pool;
+}
+
+void
+task_pool_delete(struct task_pool **poolp)
+{
+    struct task_pool *pool = poolp && (*poolp) ? (*poolp) : NULL;
+    if (!pool) return;
+
+    if (pool->workers) {
+        pthread_mutex_lock(&pool->mtx);
+        __atomic_store_n(&pool->thread_abort, 1, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->mtx);
+
+        for (unsigned int i = 0; i < pool->number; i++) {
+            if (pool->workers[i].is_thread_ready)
+                pthread_join(pool->workers[i].thread_fd, NULL);
+        }
+
+        /* drop what nobody ran */
+        for (unsigned int i = 0; i < pool->number; i++) {
+            struct task_worker *worker = &pool->workers[i];
+            struct task *task;
+
+            if (!worker->deque.array)
+                continue;
+            while ((task = _deque_take(&worker->deque)) != NULL)
+                free(task);
+            while ((task = worker->inbox) != NULL) {
+                worker->inbox = task->next;
+                free(task);
+            }
+            _deque_destroy(&worker->deque);
+        }
+        free(pool->workers);
+    }
+
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->mtx);
+    free(pool);
+    *poolp = NULL;
+}
+
+int
+task_pool_submit(struct task_pool *pool,
+                 struct event_loop *eloop,
+                 task_pool_work_proc on_work,
+                 task_pool_done_proc on_done,
+                 void *userdata)
+{
+    struct task_worker *self = (struct task_worker *) pthread_getspecific(_worker_key);
+    struct task *task;
+
+    if (!on_work)  return -1;
+
+    task = (struct task *) calloc(1, sizeof(*task));
+    if (!task)
+        return -1;
+    task->on_work = on_work;
+    task->on_done = on_done;
+    task->eloop = eloop;
+    task->userdata = userdata;
+
+    __atomic_add_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+
+    /* from a worker of this pool, its own deque, otherwise spread the inboxes */
+    if (!self || self->pool != pool || _deque_push(&self->deque, task) != 0) {
+        unsigned int index = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED) % pool->number;
+
+        _inbox_push(&pool->workers[index], task);
+    }
+
+    if (__atomic_load_n(&pool->sleepers, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&pool->mtx);
+        pthread_cond_signal(&pool->cond);
+        pthread_mutex_unlock(&pool->mtx);
+    }
+    return 0;
+}
@@ -0,0 +1,45 @@
+#ifndef __TASK_POOL_H__
+#define __TASK_POOL_H__
+
+#include "event_loop.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * work-stealing worker threads for cpu heavy or blocking work, so it does
+ * not stall the connections of an event loop.
+ *
+ * every worker owns a deque and an inbox, idle workers steal from the
+ * others, the result comes back to the submitting loop as a job.
+ */
+
+struct task_pool;
+
+/* runs on a worker thread, returns the result for on_done */
+typedef void *(*task_pool_work_proc)(void *userdata);
+/* 
+ * runs on the thread of the loop given to submit, eloop is NULL when that
+ * loop was deleted with the result still queued, to release it.
+ */
+typedef int (*task_pool_done_proc)(struct event_loop *eloop,
+                                   void *result,
+                                   void *userdata);
+
+/* 0 threads uses 4 */
+struct task_pool *task_pool_create(unsigned int thread_number);
+/* delete before the loops completions go to, queued tasks are dropped */
+void task_pool_delete(struct task_pool **pool);
+
+/* eloop or on_done may be NULL when nobody waits for the result */
+int task_pool_submit(struct task_pool *pool,
+                     struct event_loop *eloop,
+                     task_pool_work_proc on_work,
+                     task_pool_done_proc on_done,
+                     void *userdata);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
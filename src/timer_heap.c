@@ -0,0 +1,149 @@
+/*
+ * timer heap
+ *
+ * Copyright (c) 2024 kyleliu <justfavme at gmail dot com>
+ * All rights reserved.
+ *
+ * This file is part of Eloop.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "timer_heap.h"
+
+struct timer_heap {
+    struct timer_heap_node **nodes;
+    int length;
+    int capacity;
+};
+
+static void
+_set(struct timer_heap *heap, int index, struct timer_heap_node *node)
+{
+    heap->nodes[index] = node;
+    node->index = index;
+}
+
+static void
+_up(struct timer_heap *heap, int index)
+{
+    struct timer_heap_node *node = heap->nodes[index];
+
+    while (index > 0) {
+        int parent = (index - 1) / 2;
+
+        if (heap->nodes[parent]->expire <= node->expire)
+            break;
+        _set(heap, index, heap->nodes[parent]);
+        index = parent;
+    }
+    _set(heap, index, node);
+}
+
+static void
+_down(struct timer_heap *heap, int index)
+{
+    struct timer_heap_node *node = heap->nodes[index];
+
+    for (;;) {
+        int child = index * 2 + 1;
+
+        if (child >= heap->length)
+            break;
+        if (child + 1 < heap->length && heap->nodes[child + 1]->expire < heap->nodes[child]->expire)
+            child++;
+        if (node->expire <= heap->nodes[child]->expire)
+            break;
+        _set(heap, index, heap->nodes[child]);
+        index = child;
+    }
+    _set(heap, index, node);
+}
+
+struct timer_heap *
+timer_heap_create(void)
+{
+    return (struct timer_heap *) calloc(1, sizeof(struct timer_heap));
+}
+
+void
+timer_heap_delete(struct timer_heap **heapp)
+{
+    struct timer_heap *heap = heapp && (*heapp) ? (*heapp) : NULL;
+    if (!heap)  return;
+
+    /* nodes belong to the caller */
+    free(heap->nodes);
+    free(heap);
+    *heapp = NULL;
+}
+
+void
+timer_heap_node_init(struct timer_heap_node *node)
+{
+    node->expire = 0;
+    node->index = -1;
+}
+
+int
+timer_heap_node_is_added(struct timer_heap_node *node)
+{
+    return node->index >= 0;
+}
+
+int
+timer_heap_add(struct timer_heap *heap, struct timer_heap_node *node, unsigned long long expire)
+{
+    if (node->index >= 0)
+        timer_heap_remove(heap, node);
+
+    if (heap->length == heap->capacity) {
+        int capacity = heap->capacity ? heap->capacity * 2 : 64;
+        struct timer_heap_node **nodes = (struct timer_heap_node **) realloc(heap->nodes, capacity * sizeof(*nodes));
+
+        if (!nodes) return -1;
+        heap->nodes = nodes;
+        heap->capacity = capacity;
+    }
+
+    node->expire = expire;
+    _set(heap, heap->length++, node);
+    _up(heap, node->index);
+    return 0;
+}
+
+void
+timer_heap_remove(struct timer_heap *heap, struct timer_heap_node *node)
+{
+    int index = node->index;
+    struct timer_heap_node *last;
+
+    if (index < 0)
+        return;
+
+    node->index = -1;
+    last = heap->nodes[--heap->length];
+    if (last == node)
+        return;
+
+    /* the last one fills the hole and moves either way */
+    _set(heap, index, last);
+    if (index > 0 && heap->nodes[(index - 1) / 2]->expire > last->expire)
+        _up(heap, index);
+    else
+        _down(heap, index);
+}
+
+size_t
+timer_heap_get_length(struct timer_heap *heap)
+{
+    return (size_t) heap->length;
+}
+
+struct timer_heap_node *
+timer_heap_top(struct timer_heap *heap)
+{
+    return heap->length > 0 ? heap->nodes[0] : NULL;
+}
@@ -0,0 +1,41 @@
+#ifndef __TIMER_HEAP_H__
+#define __TIMER_HEAP_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * binary min-heap of expires, non-thread safe.
+ *
+ * nodes are embedded in the caller's timer and remember their index, so
+ * remove is O(log n) without searching.
+ */
+
+struct timer_heap;
+
+struct timer_heap_node {
+    /* absolute, in the caller's unit */
+    unsigned long long expire;
+    /* index in the heap, -1 when not added */
+    int index;
+};
+
+struct timer_heap *timer_heap_create(void);
+void timer_heap_delete(struct timer_heap **heap);
+
+void timer_heap_node_init(struct timer_heap_node *node);
+int timer_heap_node_is_added(struct timer_heap_node *node);
+
+int timer_heap_add(struct timer_heap *heap, struct timer_heap_node *node, unsigned long long expire);
+void timer_heap_remove(struct timer_heap *heap, struct timer_heap_node *node);
+
+size_t timer_heap_get_length(struct timer_heap *heap);
+
+/* earliest node, NULL when empty */
+struct timer_heap_node *timer_heap_top(struct timer_heap *heap);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,290 @@
+/*
+ * timer wheel
+ *
+ * Copyright (c) 2024 kyleliu <justfavme at gmail dot com>
+ * All rights reserved.
+ *
+ * This file is part of Eloop.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "timer_wheel.h"
+
+#define WHEEL_BITS      8
+#define WHEEL_SIZE      (1 << WHEEL_BITS)
+#define WHEEL_MASK      (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS    4
+#define WHEEL_WORDS     (WHEEL_SIZE / 64)
+#define WHEEL_SPAN      (1ULL << (WHEEL_BITS * WHEEL_LEVELS))
+/* slot of nodes detached for firing */
+#define WHEEL_PENDING   (WHEEL_LEVELS * WHEEL_SIZE)
+
+/*
+ * level n slot covers 256^n ticks, a node stays in the slot of its expire at
+ * the lowest level that reaches it, and moves down when that slot cascades.
+ * bitmap marks non-empty slots so the next expire is found without walking.
+ */
+struct timer_wheel {
+    /* next tick to process */
+    unsigned long long now;
+    size_t length;
+    struct timer_wheel_node slots[WHEEL_LEVELS * WHEEL_SIZE];
+    unsigned long long bitmap[WHEEL_LEVELS][WHEEL_WORDS];
+};
+
+static void
+_list_init(struct timer_wheel_node *head)
+{
+    head->prev = head->next = head;
+}
+
+static int
+_list_is_empty(struct timer_wheel_node *head)
+{
+    return head->next == head;
+}
+
+static void
+_list_append(struct timer_wheel_node *head, struct timer_wheel_node *node)
+{
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+static void
+_list_unlink(struct timer_wheel_node *node)
+{
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = node->next = NULL;
+}
+
+/* move all nodes of src to the empty dst */
+static void
+_list_take(struct timer_wheel_node *dst, struct timer_wheel_node *src)
+{
+    _list_init(dst);
+    if (_list_is_empty(src))
+        return;
+
+    dst->next = src->next;
+    dst->prev = src->prev;
+    dst->next->prev = dst;
+    dst->prev->next = dst;
+    _list_init(src);
+}
+
+/* distance from slot `from` to the next set slot cyclically, -1 when none */
+static int
+_bitmap_find(const unsigned long long *bits, int from)
+{
+    for (int i = 0; i < WHEEL_SIZE; /**/) {
+        int pos = (from + i) & WHEEL_MASK;
+        int bit = pos & 63;
+        unsigned long long word = bits[pos >> 6] >> bit;
+
+        if (word)
+            return i + __builtin_ctzll(word);
+        i += 64 - bit;
+    }
+    return -1;
+}
+
+static void
+_place(struct timer_wheel *wheel, struct timer_wheel_node *node)
+{
+    unsigned long long expire = node->expire < wheel->now ? wheel->now : node->expire;
+    unsigned long long delta = expire - wheel->now;
+    int level, index;
+
+    /* farther timers wait at the top and are placed again later */
+    if (delta >= WHEEL_SPAN) {
+        delta = WHEEL_SPAN - 1;
+        expire = wheel->now + delta;
+    }
+
+    for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+        if (delta < (1ULL << (WHEEL_BITS * (level + 1))))
+            break;
+    }
+
+    index = (int) ((expire >> (WHEEL_BITS * level)) & WHEEL_MASK);
+    node->slot = level * WHEEL_SIZE + index;
+    _list_append(&wheel->slots[node->slot], node);
+    wheel->bitmap[level][index >> 6] |= 1ULL << (index & 63);
+}
+
+static void
+_detach(struct timer_wheel *wheel, int level, int index, struct timer_wheel_node *head)
+{
+    _list_take(head, &wheel->slots[level * WHEEL_SIZE + index]);
+    wheel->bitmap[level][index >> 6] &= ~(1ULL << (index & 63));
+}
+
+static void
+_cascade(struct timer_wheel *wheel, int level, int index)
+{
+    struct timer_wheel_node head;
+
+    _detach(wheel, level, index, &head);
+    while (!_list_is_empty(&head)) {
+        struct timer_wheel_node *node = head.next;
+
+        _list_unlink(node);
+        _place(wheel, node);
+    }
+}
+
+struct timer_wheel *
+timer_wheel_create(unsigned long long now)
+{
+    struct timer_wheel *wheel = (struct timer_wheel *) calloc(1, sizeof(*wheel));
+
+    if (wheel) {
+        wheel->now = now;
+        for (int i = 0; i < WHEEL_LEVELS * WHEEL_SIZE; i++)
+            _list_init(&wheel->slots[i]);
+    }
+    return wheel;
+}
+
+void
+timer_wheel_delete(struct timer_wheel **wheelp)
+{
+    struct timer_wheel *wheel = wheelp && (*wheelp) ? (*wheelp) : NULL;
+    if (!wheel) return;
+
+    /* nodes belong to the caller */
+    free(wheel);
+    *wheelp = NULL;
+}
+
+void
+timer_wheel_node_init(struct timer_wheel_node *node)
+{
+    node->prev = node->next = NULL;
+    node->expire = 0;
+    node->slot = -1;
+}
+
+int
+timer_wheel_node_is_added(struct timer_wheel_node *node)
+{
+    return node->slot >= 0;
+}
+
+void
+timer_wheel_add(struct timer_wheel *wheel, struct timer_wheel_node *node, unsigned long long expire)
+{
+    if (node->slot >= 0)
+        timer_wheel_remove(wheel, node);
+
+    node->expire = expire;
+    _place(wheel, node);
+    wheel->length++;
+}
+
+void
+timer_wheel_remove(struct timer_wheel *wheel, struct timer_wheel_node *node)
+{
+    int slot = node->slot;
+
+    if (slot < 0)
+        return;
+
+    _list_unlink(node);
+    if (slot != WHEEL_PENDING && _list_is_empty(&wheel->slots[slot])) {
+        int level = slot / WHEEL_SIZE;
+        int index = slot % WHEEL_SIZE;
+
+        wheel->bitmap[level][index >> 6] &= ~(1ULL << (index & 63));
+    }
+    node->slot = -1;
+    wheel->length--;
+}
+
+size_t
+timer_wheel_get_length(struct timer_wheel *wheel)
+{
+    return wheel->length;
+}
+
+unsigned long long
+timer_wheel_next(struct timer_wheel *wheel)
+{
+    unsigned long long ret = TIMER_WHEEL_NEVER;
+
+    if (wheel->length == 0)
+        return ret;
+
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        int shift = WHEEL_BITS * level;
+        /* first slot boundary not processed yet */
+        unsigned long long first = (wheel->now + (1ULL << shift) - 1) >> shift;
+        int distance = _bitmap_find(wheel->bitmap[level], (int) (first & WHEEL_MASK));
+
+        if (distance >= 0) {
+            unsigned long long tick = (first + distance) << shift;
+            if (tick < ret)     ret = tick;
+        }
+    }
+
+    return ret;
+}
+
+int
+timer_wheel_expire(struct timer_wheel *wheel,
+                   unsigned long long now,
+                   timer_wheel_proc proc,
+                   void *userdata)
+{
+    int count = 0;
+
+    while (wheel->now <= now) {
+        struct timer_wheel_node pending;
+        unsigned long long tick = timer_wheel_next(wheel);
+
+        /* only empty slots in between */
+        if (tick > now) {
+            wheel->now = now + 1;
+            break;
+        }
+        wheel->now = tick;
+
+        /* higher level first, its nodes may fall into the lower slot of this tick */
+        for (int level = WHEEL_LEVELS - 1; level > 0; level--) {
+            int shift = WHEEL_BITS * level;
+
+            if ((tick & ((1ULL << shift) - 1)) == 0)
+                _cascade(wheel, level, (int) ((tick >> shift) & WHEEL_MASK));
+        }
+
+        _detach(wheel, 0, (int) (tick & WHEEL_MASK), &pending);
+        for (struct timer_wheel_node *node = pending.next; node != &pending; node = node->next)
+            node->slot = WHEEL_PENDING;
+        wheel->now = tick + 1;
+
+        while (!_list_is_empty(&pending)) {
+            struct timer_wheel_node *node = pending.next;
+
+            _list_unlink(node);
+            /* clamped far timer */
+            if (node->expire > tick) {
+                _place(wheel, node);
+                continue;
+            }
+
+            node->slot = -1;
+            wheel->length--;
+            count++;
+            proc(wheel, node, userdata);
+        }
+    }
+
+    return count;
+}
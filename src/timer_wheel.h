@@ -0,0 +1,57 @@
+#ifndef __TIMER_WHEEL_H__
+#define __TIMER_WHEEL_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * hierarchical timing wheel, 4 levels of 256 slots, the tick unit is up to
+ * the caller, non-thread safe.
+ *
+ * nodes are embedded in the caller's timer, insert and remove are O(1),
+ * timers farther than 2^32 ticks are re-placed when their slot cascades.
+ */
+
+#define TIMER_WHEEL_NEVER   (~0ULL)
+
+struct timer_wheel;
+
+struct timer_wheel_node {
+    struct timer_wheel_node *prev;
+    struct timer_wheel_node *next;
+    /* absolute tick */
+    unsigned long long expire;
+    /* slot in the wheel, -1 when not added */
+    int slot;
+};
+
+typedef void (*timer_wheel_proc)(struct timer_wheel *wheel,
+                                 struct timer_wheel_node *node,
+                                 void *userdata);
+
+struct timer_wheel *timer_wheel_create(unsigned long long now);
+void timer_wheel_delete(struct timer_wheel **wheel);
+
+void timer_wheel_node_init(struct timer_wheel_node *node);
+int timer_wheel_node_is_added(struct timer_wheel_node *node);
+
+/* expire before the current tick fires on the next expire call */
+void timer_wheel_add(struct timer_wheel *wheel, struct timer_wheel_node *node, unsigned long long expire);
+void timer_wheel_remove(struct timer_wheel *wheel, struct timer_wheel_node *node);
+
+size_t timer_wheel_get_length(struct timer_wheel *wheel);
+
+/* lower bound of the earliest expire, TIMER_WHEEL_NEVER when empty */
+unsigned long long timer_wheel_next(struct timer_wheel *wheel);
+
+/* fire every node expired at now, proc may add or remove nodes */
+int timer_wheel_expire(struct timer_wheel *wheel,
+                       unsigned long long now,
+                       timer_wheel_proc proc,
+                       void *userdata);
+
+#ifdef __cplusplus
+}
+#endif
+#endif